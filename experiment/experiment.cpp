@@ -1,15 +1,19 @@
 #include <gtest/gtest.h>
 #include <math.h>
 #include <thread>
+#include <random>
+#include <algorithm>
 #include <chrono>
 #include <atomic>
 #include "../include/buffer_tree.h"
+#include "../include/sharded_buffer_tree.h"
 
 #define KB (uint64_t (1 << 10))
 #define MB (uint64_t (1 << 20))
 #define GB (uint64_t (1 << 30))
 
 static bool shutdown = false;
+static bool use_leases = false; // do queriers lease data instead of copying it
 static std::atomic<uint64_t> upd_processed;
 
 // queries the buffer tree and verifies that the data
@@ -17,6 +21,19 @@ static std::atomic<uint64_t> upd_processed;
 // Should be run in a seperate thread
 void querier(BufferTree *buf_tree, int nodes) {
   data_ret_t data;
+  LeafLease lease;
+  while(use_leases) {
+    bool valid = buf_tree->lease_data(lease);
+    if (valid) {
+      for (Node upd : lease) {
+        ASSERT_EQ(nodes - (lease.key + 1), upd) << "key " << lease.key;
+        upd_processed += 1;
+      }
+      buf_tree->release_data(lease);
+    }
+    else if(shutdown)
+      return;
+  }
   while(true) {
     bool valid = buf_tree->get_data(data);
     if (valid) {
@@ -54,11 +71,20 @@ void progress(const uint64_t num_updates) {
 // and no work is claimed off of the work queue
 // to work correctly num_updates must be a multiple of nodes
 void run_test(const int nodes, const uint64_t num_updates, const uint64_t buffer_size, 
- const int branch_factor, const int threads=1) {
-    printf("Running Test: nodes=%i num_updates=%lu buffer_size %lu branch_factor %i\n",
-         nodes, num_updates, buffer_size, branch_factor);
+ const int branch_factor, const int threads=1, const int flush_workers=0, 
+ const flush_kernel_t kernel=SCATTER_KERNEL, const storage_t storage=FILE_STORAGE,
+ const bool direct_io=false) {
+    printf("Running Test: nodes=%i num_updates=%lu buffer_size %lu branch_factor %i flush_workers %i kernel %s storage %s%s\n",
+         nodes, num_updates, buffer_size, branch_factor, flush_workers, 
+         (kernel == RADIX_KERNEL)? "radix" : "scatter",
+         (storage == URING_STORAGE)? "io_uring" : (storage == MEMORY_STORAGE)? "memory" : (storage == MMAP_STORAGE)? "mmap" : "file", direct_io? " O_DIRECT" : "");
 
-    BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, threads, true);
+    BufferTreeOptions opts;
+    opts.flush_workers = flush_workers;
+    opts.storage       = storage;
+    opts.direct_io     = direct_io;
+    BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, threads, true, opts);
+    buf_tree->set_flush_kernel(kernel);
     shutdown = false;
     upd_processed = 0;
 
@@ -91,6 +117,51 @@ void run_test(const int nodes, const uint64_t num_updates, const uint64_t buffer
     delete buf_tree;
 }
 
+// insert the same stream with a number of concurrent producer threads
+// and report the insertion rate. Each producer inserts its own slice
+// of the updates.
+void run_parallel_test(const int nodes, const uint64_t num_updates, const uint64_t buffer_size,
+ const int branch_factor, const int producers, const int threads=4) {
+    printf("Running Parallel Test: nodes=%i num_updates=%lu buffer_size %lu branch_factor %i producers %i\n",
+         nodes, num_updates, buffer_size, branch_factor, producers);
+
+    BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, threads, true);
+    shutdown = false;
+    upd_processed = 0;
+
+    std::thread query_threads[threads];
+    for (int t = 0; t < threads; t++) {
+        query_threads[t] = std::thread(querier, buf_tree, nodes);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer_threads[producers];
+    for (int p = 0; p < producers; p++) {
+        producer_threads[p] = std::thread([=]() {
+            for (uint64_t i = p; i < num_updates; i += producers) {
+                update_t upd;
+                upd.first = i % nodes;
+                upd.second = (nodes - 1) - (i % nodes);
+                buf_tree->insert(upd);
+            }
+        });
+    }
+    for (int p = 0; p < producers; p++) {
+        producer_threads[p].join();
+    }
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("%i producers: insertions took %f seconds: average rate = %f\n", producers, delta.count(), num_updates/delta.count());
+    buf_tree->force_flush();
+    shutdown = true;
+    buf_tree->set_non_block(true); // tell any waiting threads to reset
+
+    for (int t = 0; t < threads; t++) {
+        query_threads[t].join();
+    }
+    ASSERT_EQ(num_updates, upd_processed);
+    delete buf_tree;
+}
+
 TEST(Experiment, LargeStandard) {
     const int nodes            = 512;
     const uint64_t num_updates = MB << 5;
@@ -100,6 +171,15 @@ TEST(Experiment, LargeStandard) {
     run_test(nodes, num_updates, buf, branch);
 }
 
+TEST(Experiment, LargeStandardAsync) {
+    const int nodes            = 512;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+    const int branch           = 8;
+
+    run_test(nodes, num_updates, buf, branch, 1, 4);
+}
+
 TEST(Experiment, LargeWide) {
     const int nodes            = 512;
     const uint64_t num_updates = MB << 5;
@@ -118,6 +198,584 @@ TEST(Experiment, ExtraLarge) {
     run_test(nodes, num_updates, buf, branch);
 }
 
+// the same stream as run_test, inserted in blocks of batch_size updates
+void run_batch_test(const int nodes, const uint64_t num_updates, const uint64_t buffer_size,
+ const int branch_factor, const uint64_t batch_size) {
+    printf("Running Batch Test: nodes=%i num_updates=%lu buffer_size %lu branch_factor %i batch_size %lu\n",
+         nodes, num_updates, buffer_size, branch_factor, batch_size);
+
+    BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, 1, true);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworker(querier, buf_tree, nodes);
+
+    std::vector<update_t> batch(batch_size);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_updates; i += batch_size) {
+        for (uint64_t j = 0; j < batch_size; j++) {
+            batch[j].first  = (i + j) % nodes;
+            batch[j].second = (nodes - 1) - ((i + j) % nodes);
+        }
+        buf_tree->insert_batch(batch.data(), batch_size);
+    }
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("batched insertions took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+    buf_tree->force_flush();
+    shutdown = true;
+    buf_tree->set_non_block(true); // tell any waiting threads to reset
+
+    qworker.join();
+    ASSERT_EQ(num_updates, upd_processed);
+    delete buf_tree;
+}
+
+TEST(Experiment, LargeStandardBatched) {
+    const int nodes            = 512;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+    const int branch           = 8;
+
+    run_batch_test(nodes, num_updates, buf, branch, 4096);
+    run_batch_test(nodes, num_updates, buf, branch, MB / 8);
+}
+
+// how quickly serialized updates can be routed to the children of the root
+TEST(Experiment, RoutingThroughput) {
+    const Node nodes           = 250000;
+    const uint64_t num_updates = MB << 3;
+    std::vector<update_t> updates(num_updates);
+    for (uint64_t i = 0; i < num_updates; i++) {
+        updates[i].first  = (i * 2654435761u) % nodes;
+        updates[i].second = i % nodes;
+    }
+    const char *data = reinterpret_cast<const char *>(updates.data());
+
+    for (uint16_t branch : {8, 16, 256}) {
+        ChildRouter router;
+        router.init(0, nodes - 1, branch);
+        std::vector<uint64_t> counts(branch);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < 10; r++) {
+            for (uint64_t i = 0; i < num_updates; i++) {
+                Node key;
+                memcpy(&key, data + i * BufferTree::serial_update_size, sizeof(Node));
+                counts[router.route(key)]++;
+            }
+        }
+        std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+        double mb = 10.0 * num_updates * BufferTree::serial_update_size / MB;
+        printf("branch factor %u: routed %.0f MB in %f seconds: %f MB/s (check %lu)\n", branch, mb, delta.count(), mb / delta.count(), counts[0]);
+    }
+}
+
+// compare the flush kernels across branching factors
+TEST(Experiment, FlushKernels) {
+    const int nodes            = 4096;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+
+    for (int branch : {8, 16, 256}) {
+        run_test(nodes, num_updates, buf, branch, 1, 0, SCATTER_KERNEL);
+        run_test(nodes, num_updates, buf, branch, 1, 0, RADIX_KERNEL);
+    }
+}
+
+// compare one pwrite per child against a single io_uring submission per flush
+// and against keeping the whole tree in memory or in a mapped file
+TEST(Experiment, IOBackends) {
+    const int nodes            = 4096;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+
+    for (int branch : {16, 256}) {
+        for (int workers : {0, 4}) {
+            run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, FILE_STORAGE);
+            run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, URING_STORAGE);
+            run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, MEMORY_STORAGE);
+            run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, MMAP_STORAGE);
+        }
+    }
+}
+
+// the page cache against O_DIRECT, which trades extra reads of partial
+// pages for bounded memory use
+TEST(Experiment, DirectIO) {
+    const int nodes            = 4096;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+
+    for (int workers : {0, 4}) {
+        run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, FILE_STORAGE, false);
+        run_test(nodes, num_updates, buf, branch, 1, workers, SCATTER_KERNEL, FILE_STORAGE, true);
+    }
+}
+
+// rate at which consumers peek and pop leaves from the circular queue as
+// the number of consumers grows, taking one leaf or a batch at a time.
+// Producers push leaf sized elements
+TEST(Experiment, QueueScaling) {
+    const int producers        = 4;
+    const uint64_t num_elms    = 1 << 21;
+    const int elm_size         = 4 * KB;
+
+    for (int batch : {1, 8})
+    for (int consumers : {1, 2, 4, 8, 16, 40}) {
+        CircularQueue cq(8 * consumers, elm_size);
+        std::atomic<uint64_t> popped(0);
+        char elm[elm_size];
+        memset(elm, 1, elm_size);
+
+        auto start = std::chrono::steady_clock::now();
+        std::thread cons[consumers];
+        for (int c = 0; c < consumers; c++) {
+            cons[c] = std::thread([&]() {
+                std::pair<int, queue_elm> data[8];
+                int n;
+                while ((n = cq.peek_batch(data, batch, 64 * KB)) > 0) {
+                    cq.pop_batch(data[0].first, n);
+                    popped += n;
+                }
+            });
+        }
+        std::thread prods[producers];
+        for (int p = 0; p < producers; p++) {
+            prods[p] = std::thread([&]() {
+                for (uint64_t i = 0; i < num_elms / producers; i++)
+                    cq.push(elm, 256); // a small leaf
+            });
+        }
+        for (int p = 0; p < producers; p++) prods[p].join();
+        while (popped < num_elms) std::this_thread::yield();
+        std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+        cq.set_no_block(true);
+        for (int c = 0; c < consumers; c++) cons[c].join();
+        printf("consumers %i batch %i: %lu peek/pops in %f seconds, rate = %f\n", 
+            consumers, batch, num_elms, delta.count(), num_elms / delta.count());
+    }
+}
+
+// consumers copying leaves into vectors against leasing them in place
+TEST(Experiment, LeaseConsumers) {
+    const int nodes            = 1024;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+
+    for (int threads : {1, 4}) {
+        use_leases = false;
+        run_test(nodes, num_updates, buf, branch, threads, 0, SCATTER_KERNEL, MEMORY_STORAGE);
+        use_leases = true;
+        run_test(nodes, num_updates, buf, branch, threads, 0, SCATTER_KERNEL, MEMORY_STORAGE);
+    }
+    use_leases = false;
+}
+
+// consumers which keep a sketch like block of state per node, taking leaves
+// from one shared queue or from per consumer queues with key affinity
+void run_affinity_test(const int workers, const bool affinity) {
+    const int nodes            = 4096;
+    const uint64_t num_updates = MB << 5;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    const int state_words      = 512; // 4KB of state per node
+    printf("Running Test: consumers %i %s\n", workers, affinity? "key affinity" : "shared queue");
+
+    BufferTreeOptions opts;
+    opts.storage         = MEMORY_STORAGE;
+    opts.consumer_queues = affinity? workers : 0;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, workers, true, opts);
+    std::vector<uint64_t> state((uint64_t) nodes * state_words);
+    shutdown = false;
+    upd_processed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread query_threads[workers];
+    for (int w = 0; w < workers; w++) {
+        query_threads[w] = std::thread([&, w]() {
+            LeafLease lease;
+            while(true) {
+                if (buf_tree->lease_data(lease, w)) {
+                    uint64_t *node_state = &state[(uint64_t) lease.key * state_words];
+                    uint64_t n = 0;
+                    for (Node upd : lease) {
+                        node_state[(upd * 31) % state_words] ^= upd;
+                        n++;
+                    }
+                    upd_processed += n;
+                    buf_tree->release_data(lease);
+                }
+                else if(shutdown)
+                    return;
+            }
+        });
+    }
+
+    for (uint64_t i = 0; i < num_updates; i++) {
+        buf_tree->insert({i % nodes, (nodes - 1) - (i % nodes)});
+    }
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("insert+process took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    for (int w = 0; w < workers; w++) {
+        query_threads[w].join();
+    }
+    delete buf_tree;
+}
+
+TEST(Experiment, KeyAffinity) {
+    for (int workers : {4, 16}) {
+        run_affinity_test(workers, false);
+        run_affinity_test(workers, true);
+    }
+}
+
+// consumers which stall now and then, as they would for a slow downstream
+void run_bursty_test(const int workers, const uint64_t max_queue_bytes) {
+    const int nodes            = 4096;
+    const uint64_t num_updates = MB << 4;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    printf("Running Test: consumers %i max queue bytes %lu\n", workers, max_queue_bytes);
+
+    BufferTreeOptions opts;
+    opts.max_queue_bytes = max_queue_bytes;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, workers, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread query_threads[workers];
+    for (int w = 0; w < workers; w++) {
+        query_threads[w] = std::thread([&]() {
+            data_ret_t data;
+            uint64_t leaves = 0;
+            while(true) {
+                if (buf_tree->get_data(data)) {
+                    upd_processed += data.second.size();
+                    if (++leaves % 32 == 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+                else if(shutdown)
+                    return;
+            }
+        });
+    }
+
+    for (uint64_t i = 0; i < num_updates; i++) {
+        buf_tree->insert({i % nodes, (nodes - 1) - (i % nodes)});
+    }
+    std::chrono::duration<double> ins = std::chrono::steady_clock::now() - start;
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    queue_stats_t stats = buf_tree->get_queue_stats();
+    printf("insertions took %f seconds, insert+process took %f seconds\n", ins.count(), delta.count());
+    printf("producers blocked %lu times for %f seconds, queue depth %lu bytes, grew %lu shrank %lu\n",
+      stats.producer_blocks, stats.producer_blocked_ns / 1e9, stats.depth_bytes, stats.grows,
+      stats.shrinks);
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    for (int w = 0; w < workers; w++) {
+        query_threads[w].join();
+    }
+    delete buf_tree;
+}
+
+TEST(Experiment, AdaptiveQueue) {
+    for (int workers : {2, 8}) {
+        run_bursty_test(workers, 0);
+        run_bursty_test(workers, 64 * MB);
+    }
+}
+
+// a power law stream where a few keys receive most of the updates
+void run_skewed_test(const uint32_t hot_keys) {
+    const int nodes            = 1 << 16;
+    const uint64_t num_updates = MB << 4;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    printf("Running Test: skewed stream hot keys %u\n", hot_keys);
+
+    std::vector<update_t> upds(num_updates);
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    for (uint64_t i = 0; i < num_updates; i++) {
+        Node src = (Node) (nodes * pow(uniform(rng), 6));
+        upds[i] = {src, (nodes - 1) - src};
+    }
+
+    BufferTreeOptions opts;
+    opts.hot_keys = hot_keys;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 1, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworker(querier, buf_tree, nodes);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_updates; i++) {
+        buf_tree->insert(upds[i]);
+    }
+    std::chrono::duration<double> ins = std::chrono::steady_clock::now() - start;
+    printf("insertions took %f seconds\n", ins.count());
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("insert+process took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    qworker.join();
+    delete buf_tree;
+}
+
+TEST(Experiment, HotKeys) {
+    run_skewed_test(0);
+    run_skewed_test(64);
+    run_skewed_test(256);
+}
+
+// a churn heavy stream where most edges are inserted and soon deleted again
+void run_churn_test(const combine_t combine) {
+    const int nodes            = 1 << 12;
+    const uint64_t num_updates = MB << 4;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    printf("Running Test: churn stream combine %i\n", combine);
+
+    std::vector<update_t> upds(num_updates);
+    std::mt19937_64 rng(42);
+    for (uint64_t i = 0; i + 1 < num_updates; i += 2) {
+        upds[i] = {rng() % nodes, 1 + rng() % (nodes - 1)};
+        // three quarters of edges are deleted right away
+        upds[i + 1] = (rng() % 4 == 0)? update_t{rng() % nodes, 1 + rng() % (nodes - 1)} : upds[i];
+    }
+
+    BufferTreeOptions opts;
+    opts.combine = combine;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 1, true, opts);
+    std::atomic<uint64_t> leaves(0);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworker([&]() {
+        data_ret_t data;
+        while(true) {
+            if (buf_tree->get_data(data)) {
+                upd_processed += data.second.size();
+                leaves++;
+            }
+            else if(shutdown)
+                return;
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_updates; i++) {
+        buf_tree->insert(upds[i]);
+    }
+    buf_tree->force_flush();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    qworker.join();
+    printf("insert+process took %f seconds, consumers saw %lu updates in %lu leaves\n",
+      delta.count(), (uint64_t) upd_processed, (uint64_t) leaves);
+    delete buf_tree;
+}
+
+TEST(Experiment, Combining) {
+    run_churn_test(COMBINE_NONE);
+    run_churn_test(COMBINE_LEAVES);
+    run_churn_test(COMBINE_BUFFERS);
+}
+
+// consumers which need each leaf sorted, either sorting it themselves or
+// having the tree sort it
+void run_sorted_test(const bool sort_leaves) {
+    const int nodes            = 1 << 12;
+    const uint64_t num_updates = MB << 4;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    printf("Running Test: leaves sorted by %s\n", sort_leaves? "tree" : "consumer");
+
+    BufferTreeOptions opts;
+    opts.sort_leaves = sort_leaves;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 1, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworker([&]() {
+        data_ret_t data;
+        while(true) {
+            if (buf_tree->get_data(data)) {
+                if (!sort_leaves)
+                    std::sort(data.second.begin(), data.second.end());
+                upd_processed += data.second.size();
+            }
+            else if(shutdown)
+                return;
+        }
+    });
+
+    std::mt19937_64 rng(42);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_updates; i++) {
+        buf_tree->insert({i % nodes, 1 + rng() % nodes});
+    }
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("insert+process took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    qworker.join();
+    delete buf_tree;
+}
+
+TEST(Experiment, SortedLeaves) {
+    run_sorted_test(false);
+    run_sorted_test(true);
+}
+
+// bytes this process has passed to write calls, page cache or not
+static uint64_t bytes_written() {
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == nullptr) return 0;
+    char line[128];
+    uint64_t wchar = 0;
+    while (fgets(line, sizeof(line), io) != nullptr) {
+        if (sscanf(line, "wchar: %lu", &wchar) == 1) break;
+    }
+    fclose(io);
+    return wchar;
+}
+
+void run_compact_test(const bool compact) {
+    const int nodes            = 1 << 16;
+    const uint64_t num_updates = MB << 4;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    printf("Running Test: %s encoding\n", compact? "compact" : "raw");
+
+    BufferTreeOptions opts;
+    opts.compact = compact;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 1, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworker(querier, buf_tree, nodes);
+
+    std::mt19937_64 rng(42);
+    uint64_t written = bytes_written();
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < num_updates; i++) {
+        Node src = rng() % nodes;
+        buf_tree->insert({src, (nodes - 1) - src});
+    }
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    written = bytes_written() - written;
+    printf("insert+process took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+    printf("wrote %lu MiB to the backing store, %f bytes per update\n", written >> 20,
+      (double) written / num_updates);
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    qworker.join();
+    delete buf_tree;
+}
+
+TEST(Experiment, CompactEncoding) {
+    run_compact_test(false);
+    run_compact_test(true);
+}
+
+TEST(Experiment, ParallelInsert) {
+    const int nodes            = 1024;
+    const uint64_t num_updates = MB << 6;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+
+    for (int producers = 1; producers <= 16; producers *= 2)
+        run_parallel_test(nodes, num_updates, buf, branch, producers);
+}
+
+// as run_parallel_test but with the keys split between shards, each with its
+// own root, flush workers and queues. Every producer inserts to every shard
+void run_sharded_test(const int producers, const int num_shards, const bool numa) {
+    const int nodes            = 1 << 16;
+    const uint64_t num_updates = MB << 6;
+    const uint64_t buf         = MB;
+    const int branch           = 16;
+    const int consumers        = producers;
+    printf("Running Sharded Test: producers %i shards %i numa %s\n", producers, num_shards,
+      numa? "on" : "off");
+
+    BufferTreeOptions opts;
+    opts.flush_workers = 2;
+    ShardedBufferTree *buf_tree = new ShardedBufferTree("./test_", buf, branch, nodes, consumers, true,
+      num_shards, numa, opts);
+    shutdown = false;
+    upd_processed = 0;
+
+    std::thread query_threads[consumers];
+    for (int w = 0; w < consumers; w++) {
+        query_threads[w] = std::thread([&, w]() {
+            LeafLease lease;
+            while(true) {
+                if (buf_tree->lease_data(lease, w)) {
+                    upd_processed += lease.count();
+                    buf_tree->release_data(lease);
+                }
+                else if(shutdown)
+                    return;
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer_threads[producers];
+    for (int p = 0; p < producers; p++) {
+        producer_threads[p] = std::thread([=]() {
+            for (uint64_t i = p; i < num_updates; i += producers) {
+                Node src = (i * 0x9E3779B97F4A7C15ull) >> 48; // spread over every shard
+                buf_tree->insert({src, (nodes - 1) - src});
+            }
+        });
+    }
+    for (int p = 0; p < producers; p++) {
+        producer_threads[p].join();
+    }
+    std::chrono::duration<double> ins = std::chrono::steady_clock::now() - start;
+    buf_tree->force_flush();
+    while (upd_processed < num_updates) std::this_thread::yield();
+    std::chrono::duration<double> delta = std::chrono::steady_clock::now() - start;
+    printf("%i producers %i shards: insertions took %f seconds: average rate = %f\n", producers,
+      buf_tree->num_shards(), ins.count(), num_updates/ins.count());
+    printf("insert+process took %f seconds: average rate = %f\n", delta.count(), num_updates/delta.count());
+
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    for (int w = 0; w < consumers; w++) {
+        query_threads[w].join();
+    }
+    delete buf_tree;
+}
+
+TEST(Experiment, ShardedScaling) {
+    for (int producers = 1; producers <= 16; producers *= 4) {
+        run_sharded_test(producers, 1, false);
+        run_sharded_test(producers, producers, false);
+        run_sharded_test(producers, producers, true);
+    }
+}
+
 TEST(SteadyState, HugeExperiment) {
     const int nodes            = 250000;
     const uint64_t num_updates = GB << 4; // 17 billion
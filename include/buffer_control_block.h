@@ -9,11 +9,77 @@
 #include <cstdint>
 #include <string>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include "update.h"
+#include "storage_backend.h"
 
 typedef uint32_t buffer_id_t;
-typedef uint64_t File_Pointer;
+
+// result of writing to a BufferControlBlock
+enum write_ret_t {
+  WRITE_OK,          // data written, no further action needed
+  WRITE_NEEDS_FLUSH, // data written and the buffer is now ready to be flushed
+  WRITE_FULL         // data would overflow the buffer, nothing was written
+};
+
+/*
+ * Settings of a single buffer tree which its BufferControlBlocks need.
+ * Every tree owns its own, so several trees may coexist in one process.
+ */
+struct TreeConfig {
+  uint page_size;
+  uint8_t max_level;
+  uint32_t buffer_size;
+  uint32_t buffer_capacity;      // most data an internal buffer may hold
+  uint64_t backing_EOF;
+  uint64_t leaf_size;
+  bool compact;                  // are buffers stored in the compact encoding
+  StorageBackend *backing_store; // backing file for storage
+};
+
+/*
+ * Precomputed routing of keys to the children of a node. Keys are split
+ * between the children as setup_tree does it: the first larger_kids
+ * children are responsible for one more key than the rest. Routing uses
+ * multiply-shift reciprocals so only integer arithmetic is needed.
+ */
+struct ChildRouter {
+  Node min_key;
+  Node larger_count;     // number of keys held by the larger children
+  uint32_t larger_kids;  // number of larger children
+  uint16_t options;      // number of children
+  Node big_width;        // keys per larger child
+  uint64_t big_recip;
+  Node small_width;      // keys per remaining child
+  uint64_t small_recip;
+
+  /*
+   * Compute the routing metadata for a node
+   * @param min_key  the smallest key the node is responsible for
+   * @param max_key  the largest key the node is responsible for
+   * @param options  the number of children the node has
+   */
+  void init(Node min_key, Node max_key, uint16_t options);
+
+  // the reciprocal used to divide by d. 0 if we never divide by d
+  static inline uint64_t reciprocal(uint64_t d) {return (d == 0)? 0 : UINT64_MAX / d;}
+
+  // floor(n / d) where recip = reciprocal(d). The product estimate is
+  // at most one too small so a single correction makes it exact
+  static inline uint64_t divide(uint64_t n, uint64_t d, uint64_t recip) {
+    uint64_t q = (uint64_t) (((unsigned __int128) n * recip) >> 64);
+    return q + (n - q * d >= d);
+  }
+
+  // the index (0 to options-1) of the child responsible for key
+  inline uint32_t route(Node key) const {
+    Node idx = key - min_key;
+    if (idx < larger_count)
+      return divide(idx, big_width, big_recip);
+    return divide(idx - larger_count, small_width, small_recip) + larger_kids;
+  }
+};
 
 /**
  * Buffer metadata class. Care should be taken to synchronize access to the
@@ -23,20 +89,24 @@ class BufferControlBlock {
 private:
   buffer_id_t id;
 
+  // the settings of the tree this buffer belongs to
+  const TreeConfig *config;
+
   // condition variable to determine if the buffer needs to be flushed
   // std::condition_variable needs_flushing;
 
   // how many items are currently in the buffer
   File_Pointer storage_ptr;
 
+  // the size of those items once decoded, the same as storage_ptr unless
+  // the tree uses the compact encoding
+  File_Pointer raw_ptr;
+
   // where in the file is our data stored
   File_Pointer file_offset;
 
-  /*
-   * Check if this buffer needs a flush
-   * @return true if buffer needs a flush
-   */
-  bool needs_flush();
+  // guards storage_ptr and the data this buffer holds on disk
+  std::mutex mtx;
 
 public:
   // this node's level in the tree. 0 is root, 1 is it's children, etc
@@ -50,21 +120,48 @@ public:
   Node min_key;
   Node max_key;
 
+  // how this node's keys map to its children. Set once children are added
+  ChildRouter router;
+
+  // is a flush of this buffer waiting in the flush queue
+  std::atomic<bool> flush_queued;
+
   /**
    * Generates metadata and file handle for a new buffer.
    * @param id an integer identifier for the buffer.
    * @param off the offset into the file at which this buffer's data begins
    * @param level the level in the tree this buffer resides at
+   * @param config the settings of the tree, which must outlive the buffer
    */
-  BufferControlBlock(buffer_id_t id, File_Pointer off, uint8_t level);
+  BufferControlBlock(buffer_id_t id, File_Pointer off, uint8_t level, const TreeConfig *config);
 
   /*
-   * Write to the buffer managed by this metadata.
+   * Write to the buffer managed by this metadata. Safe to call concurrently
+   * with other writes, writers must lock() to read the buffer back.
    * @param data the data to write
    * @param size the size in bytes of the data to write
-   * @return true if buffer needs flush and false otherwise
+   * @param raw_size the size in bytes of the data once decoded
+   * @return WRITE_FULL if the buffer must be flushed before the data fits,
+   *         otherwise whether the buffer needs a flush
+   */
+  write_ret_t write(const char *data, uint32_t size, uint32_t raw_size);
+  inline write_ret_t write(const char *data, uint32_t size) {return write(data, size, size);}
+
+  /*
+   * Reserve space for a write the caller performs itself. The caller must
+   * hold lock() until the write is complete.
+   * @param size the size in bytes of the data to be written
+   * @param off  set to where in the backing store the data should be written
+   * @param raw_size the size in bytes of the data once decoded
+   * @return false if the buffer must be flushed before the data fits
    */
-  bool write(char *data, uint32_t size);
+  bool reserve(uint32_t size, File_Pointer &off, uint32_t raw_size);
+
+  /*
+   * Check if this buffer needs a flush
+   * @return true if buffer needs a flush
+   */
+  bool needs_flush();
 
   /*
    * Flush the buffer this block controls
@@ -74,10 +171,17 @@ public:
 
   inline bool is_leaf()  {return min_key == max_key;}
 
-  inline void reset() {storage_ptr = 0;}
+  // hold the buffer still while its contents are read back and reset
+  inline void lock()   {mtx.lock();}
+  inline void unlock() {mtx.unlock();}
+
+  inline void reset() {storage_ptr = 0; raw_ptr = 0;}
   inline buffer_id_t get_id() {return id;}
   inline File_Pointer size() {return storage_ptr;}
+  inline File_Pointer raw_size() {return raw_ptr;}
   inline File_Pointer offset() {return file_offset;}
+  // move the buffer's data to a new location. Caller must hold the lock
+  inline void relocate(File_Pointer off) {file_offset = off;}
   inline void add_child(buffer_id_t child) {
     children_num++;
     first_child = (first_child == 0)? child : first_child;
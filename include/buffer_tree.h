@@ -2,18 +2,110 @@
 #define FASTBUFFERTREE_BUFFER_TREE_H
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <queue>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <functional>
 #include <math.h>
 #include "update.h"
 #include "buffer_control_block.h"
 #include "circular_queue.h"
+#include "flush_scheduler.h"
+#include "storage_backend.h"
+#include "hot_keys.h"
 
 typedef void insert_ret_t;
 typedef void flush_ret_t;
-typedef std::pair<Node, std::vector<Node>> data_ret_t;
+
+/*
+ * A ripe leaf lent to a consumer in place. The serialized updates stay in
+ * their circular queue slot, and the consumer walks the values of the
+ * updates directly. The slot is reused only after the lease is returned with
+ * BufferTree::release_data. So a consumer should return it promptly.
+ */
+template <class Record>
+struct BasicLeafLease {
+  Node key;          // the source node of every update in the leaf
+  const char *data;  // the serialized updates
+  uint32_t size;     // size of data in bytes
+
+  // iterates over the value of each update, its destination node by default
+  class iterator {
+  public:
+    explicit iterator(const char *pos) : pos(pos) {}
+    inline typename Record::value_t operator*() const {return Record::load_value(pos);}
+    inline iterator &operator++() {pos += Record::size; return *this;}
+    inline bool operator!=(const iterator &o) const {return pos != o.pos;}
+  private:
+    const char *pos;
+  };
+  inline iterator begin() const {return iterator(data);}
+  inline iterator end()   const {return iterator(data + size);}
+  inline size_t count()   const {return size / Record::size;}
+
+  // where the lease came from, for release_data
+  int queue;
+  int slot;
+  bool borrowed;
+};
+typedef BasicLeafLease<NodeRecord> LeafLease;
+
+// algorithms do_flush may use to partition data between children
+enum flush_kernel_t {
+  SCATTER_KERNEL, // copy each update into its child's page sized flush buffer
+  RADIX_KERNEL    // histogram then scatter into contiguous per child regions
+};
+
+// when updates are combined before they reach the consumers
+enum combine_t {
+  COMBINE_NONE,    // every update reaches the consumers
+  COMBINE_LEAVES,  // combine the updates of a leaf when it is ripe
+  COMBINE_BUFFERS  // and also those of every buffer that is flushed
+};
+
+/*
+ * Optional settings for a BufferTree. The defaults flush synchronously
+ * and access the backing store with pread and pwrite.
+ */
+template <class Record>
+struct BasicBufferTreeOptions {
+  /*
+   * Combines a run of updates sorted by source, destination and then
+   * payload in place. Only for records which are packed.
+   * @param upds  the updates
+   * @param n     the number of updates
+   * @return the number of updates left at the front of upds
+   */
+  typedef std::function<size_t(typename Record::record_t *upds, size_t n)> reducer_t;
+
+  int flush_workers = 0;            // threads flushing in the background, 0 for none
+  storage_t storage = FILE_STORAGE; // how the backing store is accessed
+  bool direct_io = false;           // open the backing store with O_DIRECT
+  int consumer_queues = 0;          // one queue per consumer, each owning a range
+                                    // of keys. 0 for a single shared queue
+  uint64_t queue_bytes = 0;         // bytes of ripe leaves each queue may hold,
+                                    // 0 for two leaves per flush worker
+  uint64_t max_queue_bytes = 0;     // if larger than queue_bytes the queues grow
+                                    // up to this many bytes rather than block
+  uint32_t hot_keys = 0;            // keys whose updates skip the tree, 0 for none
+  combine_t combine = COMBINE_NONE; // cancel identical updates before consumers see them
+  reducer_t reducer = nullptr;      // how to combine, if not set identical pairs
+                                    // of updates cancel out
+  bool sort_leaves = false;         // sort the updates of a leaf by destination
+                                    // before consumers see them
+  bool compact = false;             // store buffers sorted, delta and varint encoded
+  Node first_key = 0;               // the tree holds keys first_key to first_key + nodes - 1
+  Node graph_nodes = 0;             // the nodes of the whole graph, which leaves are
+                                    // sized for. 0 for nodes
+  int numa_node = -1;               // pin the flush workers and place memory on this NUMA node, -1 for none
+};
+typedef BasicBufferTreeOptions<NodeRecord> BufferTreeOptions;
+typedef BufferTreeOptions::reducer_t reducer_t;
 
 /*
  * Quick and dirty buffer tree skeleton.
@@ -24,13 +116,33 @@ typedef std::pair<Node, std::vector<Node>> data_ret_t;
  *    if they need to be flushed.
  * Flushing and flush-related work is handled by a dynamic thread pool.
  * A flush queue will be maintained, from which threads pick tasks.
+ * (Optional, without flush workers the inserting threads flush synchronously)
+ * Every inserting thread owns a shard of the root which it flushes into
+ * level 1 itself, so any number of threads may insert concurrently.
  * DESIGN NOTE: Currently, a buffer cannot flush to another buffer that needs to
  * be flushed. This is to prevent starvation.
+ * The layout of updates is given by Record, see RecordTraits. BufferTree
+ * holds NodeRecords, that is update_t. Trees of the other records in
+ * update.h are instantiated in buffer_tree.cpp.
+ * Trees share no state, so any number of them may be used at once as long
+ * as each has its own directory.
  */
-class BufferTree {
+template <class Record>
+class BasicBufferTree {
+public:
+  typedef typename Record::key_t key_t;
+  typedef typename Record::value_t value_t;
+  typedef typename Record::record_t record_t;
+  typedef BasicLeafLease<Record> lease_t;
+  typedef BasicBufferTreeOptions<Record> options_t;
+  typedef std::pair<key_t, std::vector<value_t>> data_ret_t;
+
 private:
-  // root directory of tree
-  std::string dir;
+  // root directories of tree, the backing store is striped across them
+  std::vector<std::string> dirs;
+
+  // the backing store if there are several directories, otherwise nullptr
+  StripedBackend *striped;
 
   // size of a buffer (leaf buffers will likely be smaller)
   uint32_t M;
@@ -41,27 +153,173 @@ private:
   // number of nodes in the graph
   Node N;
 
+  /*
+   * Information about the tree which we would like to be accesible to all
+   * the bufferControlBlocks. They keep a pointer to it
+   */
+  TreeConfig config;
+
   // metadata control block(s)
   // level 1 blocks take indices 0->(B-1). So on and so forth from there
   std::vector<BufferControlBlock*> buffers;
 
-  // buffers which we will use when performing flushes
-  // we maintain these for every level of the tree 
-  // to handle recursive flushing.
-  // TODO: a read_buffer per level is somewhat expensive
-  // we could just read back from disk instead (more IOs though)
-  char ***flush_buffers;
-  char ***flush_positions; // pointers into the flush_buffers
-  char **read_buffers;
+  /*
+   * buffers which we will use when performing a single flush. Every flush
+   * (including each level of a recursive flush) checks out its own scratch
+   * space so any number of flushes may happen at once, even at the same level.
+   */
+  struct FlushScratch {
+    char *read_buffer;       // the flushed buffer's data is read into here
+    char **flush_buffers;    // B page sized buffers staging the children's data
+    char **flush_positions;  // pointers into the flush_buffers
+    char *partition_buffer;  // RADIX_KERNEL output, allocated on first use
+    uint16_t *routes;        // RADIX_KERNEL child of each update
+    uint32_t *offsets;       // RADIX_KERNEL start of each child's region, B + 1 of them
+    uint32_t *positions;     // RADIX_KERNEL next free update of each child's region
+    char *encode_buffer;     // compact encodings, nullptr unless compact
+
+    // batches of writes to children
+    std::vector<BufferControlBlock*> batch_children;
+    std::vector<write_req_t> batch_reqs;
+    uint64_t bytes_written;  // written to children since the scratch was checked out
+  };
+
+  // scratch space not in use by any flush. Grows as needed.
+  std::vector<FlushScratch*> free_scratch;
+  std::mutex scratch_lock; // guards free_scratch and bytes_written
+  uint64_t bytes_written;  // by flushes which have returned their scratch
+  FlushScratch *checkout_scratch();
+  void return_scratch(FlushScratch *scratch);
+
+  /*
+   * A slice of the root owned by a single inserting thread.
+   * The root is double buffered, while a flush worker flushes one half the
+   * owning thread keeps inserting into the other.
+   */
+  struct RootShard {
+    char *buffer;
+    uint32_t position;
+    char *spare;             // the half of the root not being inserted to
+    bool in_flight;          // is spare being flushed by a worker
+    std::mutex lock;         // guards spare and in_flight
+    std::condition_variable flushed;
+
+    // hot key sampling and lookup done without hot_lock, see divert_hot
+    std::unordered_map<Node, uint64_t> hot_counts; // samples not yet handed over
+    uint32_t hot_skip;       // updates until the next sample
+    uint64_t hot_rng;        // xorshift state choosing the gaps between samples
+    HotSet hot_set;          // the hot keys as of the shard's last flush
+    uint64_t hot_generation;
+    char *hot_staged;        // the updates of hot keys picked out of a flush
+  };
 
   /*
-   * root node and functions for handling it
+   * root shards and functions for handling them
    */
-  char *root_node;
-  flush_ret_t flush_root();
+  std::unordered_map<std::thread::id, RootShard*> shards;
+  std::mutex shard_lock; // guards shards
+  uint64_t tree_id;      // lets threads cache their shard across trees
+  int numa_node;         // where root shards and queue buffers are placed, -1 for anywhere
+  static const uint32_t shard_cache_size = 64; // trees whose shards a thread caches
+  RootShard *new_shard();
+  inline RootShard *get_shard();
+  flush_ret_t flush_root(RootShard *shard);
   flush_ret_t flush_control_block(BufferControlBlock *bcb);
-  uint root_position;
-  std::mutex root_lock;
+
+  // wait for any flush of the shard's spare half to complete
+  void wait_root_flushed(RootShard *shard);
+
+  /*
+   * When the backing store is in memory a full leaf is handed to the
+   * circular queue in place and the leaf moves to a spare extent.
+   * The extent it left is returned once get_data is done with it.
+   */
+  std::vector<File_Pointer> spare_extents;
+  uint32_t num_spare_extents; // how many setup_tree creates
+  std::mutex extent_lock; // guards spare_extents
+  bool try_take_extent(File_Pointer &off);
+  void release_extent(const char *data);
+
+  /*
+   * Leaves which became ripe during a try_insert while their queue was full,
+   * or which were flushed in place while the buffers above them were locked.
+   * Rather than wait for consumers they are copied out and parked here, and
+   * moved to the queues as consumers make room.
+   */
+  struct ParkedLeaf {
+    Node key;
+    char *data;   // malloc'd, freed once the leaf is queued
+    uint32_t size;
+  };
+  std::vector<ParkedLeaf> parked;
+  std::mutex park_lock; // guards parked
+  std::atomic<uint64_t> parked_bytes;
+  void park_leaf(Node key, char *data, uint32_t size);
+  // push parked leaves to their queues, if may_block is false only those with room
+  void drain_parked(bool may_block);
+  // called by blocking flushes once they hold no buffer locks, so that parked
+  // leaves hold back the producers as a full queue would
+  void wait_parked();
+
+  /*
+   * Flush a full root shard so that it may accept more updates.
+   * @param may_block  if false never wait on consumers. Without flush workers
+   *                   ripe leaves are parked rather than waited on
+   * @returns false if the shard could not be flushed without blocking
+   */
+  bool make_room(RootShard *shard, bool may_block);
+
+  // insert serialized updates, returning how many bytes were accepted
+  size_t insert_data(const char *data, size_t size, bool may_block);
+
+  // copy the updates of a lease to data, throws KeyIncorrectError
+  void copy_lease(const lease_t &lease, data_ret_t &data);
+
+  // Flush worker threads. nullptr if flushes are synchronous
+  FlushScheduler *scheduler;
+
+  /*
+   * Flush a buffer which is ready to be flushed. With flush workers
+   * the flush is added to the flush queue, otherwise it is done now.
+   * @param bcb   the buffer to flush
+   * @returns nothing
+   */
+  void schedule_flush(BufferControlBlock *bcb);
+
+  // flush a buffer whose data may be accessed in place
+  flush_ret_t flush_in_place(BufferControlBlock *bcb);
+
+  /*
+   * Write flushed data to a child, flushing the child as needed
+   * @param bcb      the child to write to
+   * @param data     the data to write, which is sorted if the tree is compact
+   * @param size     the size of the data in bytes
+   * @param scratch  the flush's scratch space, to encode the data in
+   * @returns nothing
+   */
+  inline void write_child(BufferControlBlock *bcb, char *data, uint32_t size, FlushScratch *scratch);
+
+  // write data already encoded for the child, raw_size is its size once decoded
+  inline void write_encoded(BufferControlBlock *bcb, const char *data, uint32_t size,
+    uint32_t raw_size);
+
+  /*
+   * Read a locked buffer's data back, decoding it if the tree is compact.
+   * @param bcb      the buffer
+   * @param out      where the updates are placed
+   * @param scratch  provides room for the encoded data. May be nullptr unless compact
+   * @returns the size of the updates in bytes
+   */
+  uint32_t read_back(BufferControlBlock *bcb, char *out, FlushScratch *scratch);
+
+  /*
+   * Write the batch of writes queued in scratch to their children with a
+   * single write_batch call, then flush the children as needed.
+   * The children must be distinct and in increasing order of id.
+   * @param scratch  holds the batch. The batch is empty afterwards
+   * @returns nothing
+   */
+  void write_children(FlushScratch *scratch);
 
   /*
    * function which actually carries out the flush. Designed to be
@@ -69,17 +327,96 @@ private:
    * @param data        the data to flush
    * @param size        the size of the data in bytes
    * @param begin       the smallest id of the node's children
-   * @param min_key     the smalleset key this node is responsible for
-   * @param max_key     the largest key this node is responsible for
-   * @param options     the number of children this node has
-   * @param level       the level of the buffer being flushed (0 is root)
+   * @param router      how the node's keys map to its children
+   * @param scratch     the flush buffers to stage the children's data in
    * @returns nothing
    */
-  flush_ret_t do_flush(char *data, uint32_t size, uint32_t begin, 
-    Node min_key, Node max_key, uint16_t options, uint8_t level);
+  flush_ret_t do_flush(const char *data, uint32_t size, uint32_t begin, 
+    const ChildRouter &router, FlushScratch *scratch);
+
+  /*
+   * do_flush using RADIX_KERNEL. Updates are routed once to build a histogram
+   * of the children, scattered into one contiguous region per child and
+   * then each region is written to its child in one go.
+   */
+  flush_ret_t do_radix_flush(const char *data, uint32_t size, uint32_t begin,
+    const ChildRouter &router, FlushScratch *scratch);
 
-  // Circular queue in which we place leaves that fill up
-  CircularQueue *cq;
+  flush_kernel_t flush_kernel;
+
+  // see BufferTreeOptions::combine and sort_leaves
+  combine_t combine_mode;
+  typename options_t::reducer_t reducer;
+  bool sort_leaves;
+
+  /*
+   * Sort the serialized updates in data and combine them, either with the
+   * reducer or by cancelling identical pairs.
+   * @param data  the updates, which are rewritten
+   * @param size  the size of data in bytes
+   * @param leaf  do the updates all have the same source
+   * @returns the size in bytes of the combined updates
+   */
+  uint32_t combine(char *data, uint32_t size, bool leaf);
+
+  // sort and combine the updates of a ripe leaf as asked, returning the new size
+  uint32_t prepare_leaf(char *data, uint32_t size);
+
+  // routing of keys from the root to level 1
+  ChildRouter root_router;
+
+  // flush a root buffer holding size bytes into level 1
+  flush_ret_t flush_root_data(const char *data, uint32_t size);
+  // as above for the buffer of a root shard, which hot keys are diverted from
+  flush_ret_t flush_shard_data(RootShard *shard, char *data, uint32_t size);
+
+  /*
+   * Updates to the most frequent keys are moved out of root buffers and
+   * gathered in RAM, one leaf sized buffer per hot key. A full hot buffer
+   * goes straight to the circular queue so those updates are never written
+   * to the levels of the tree. nullptr if there are no hot keys.
+   */
+  HotKeys *hot_keys;
+  std::vector<char *> hot_buffers;
+  std::vector<uint32_t> hot_sizes;
+  std::vector<char *> free_hot; // empty buffers to swap for full hot buffers
+  std::mutex hot_lock; // guards hot_keys, hot_buffers, hot_sizes and free_hot
+  static const uint32_t hot_sample_rate = 16; // sample one in this many root updates, on average
+
+  // divert hot updates from a root buffer, returning the size of what is left
+  uint32_t divert_hot(RootShard *shard, char *data, uint32_t size);
+  // choose the hot keys again, taking the buffers of keys no longer hot
+  void refresh_hot(std::vector<ParkedLeaf> &full);
+  // swap a hot buffer for an empty one and add it to full. Needs hot_lock
+  void take_hot(uint32_t slot, Node key, std::vector<ParkedLeaf> &full);
+  // push taken hot buffers to the circular queues, called without hot_lock
+  void emit_hot(std::vector<ParkedLeaf> &full);
+
+  // Circular queues in which we place leaves that fill up. With a single
+  // queue any consumer takes any leaf. Otherwise each consumer owns a
+  // queue and the leaves of a range of keys, stealing from the other
+  // queues when its own is empty
+  std::vector<CircularQueue*> queues;
+  std::atomic<bool> non_block;   // should taking leaves return when none are left
+  static const int steal_poll_us = 1000; // how often an idle consumer tries to steal
+
+  // the smallest key, see BufferTreeOptions::first_key
+  Node first_key;
+
+  // the queue that ripe leaves with this key are placed in
+  inline CircularQueue *queue_for(Node key) {
+    return queues[(uint64_t) (key - first_key) * queues.size() / N];
+  }
+
+  /*
+   * Take up to max leaves, preferring the worker's own queue
+   * @param elms    where to put the leaves, room for max
+   * @param queue   set to the queue the leaves were taken from
+   * @param timeout_us  how long to wait for a leaf, forever if negative
+   * @return        the number of leaves taken, 0 if unable to get data
+   */
+  int take_leaves(std::pair<int, queue_elm> *elms, int max, uint64_t max_bytes,
+    int worker, int &queue, int64_t timeout_us);
 
 public:
   /**
@@ -93,25 +430,132 @@ public:
    * @param nodes   number of nodes in the graph
    * @param workers the number of workers which will be using this buffer tree (defaults to 1)
    * @param reset   should truncate the file storage upon opening
+   * @param flush_workers the number of threads performing flushes in the background.
+   *                0 (default) flushes synchronously on the inserting threads.
+   */
+  BasicBufferTree(std::string dir, uint32_t size, uint32_t b, Node nodes, int workers, bool reset,
+    int flush_workers=0);
+
+  /**
+   * Generates a new homebrew buffer tree with non default settings.
+   * @param opts    the settings, see BufferTreeOptions.
+   * Other parameters as above.
    */
-  BufferTree(std::string dir, uint32_t size, uint32_t b, Node nodes, int workers, bool reset);
-  ~BufferTree();
+  BasicBufferTree(std::string dir, uint32_t size, uint32_t b, Node nodes, int workers, bool reset,
+    const options_t &opts);
+
+  /**
+   * Generates a new homebrew buffer tree whose backing store is striped
+   * across several directories, for instance one per drive. Each level 1
+   * node and its subtree is placed in one of the directories in turn, and
+   * each directory has its own I/O thread. Only for file storage.
+   * @param dirs    the directories, the root of the tree is still in RAM.
+   * Other parameters as above.
+   */
+  BasicBufferTree(std::vector<std::string> dirs, uint32_t size, uint32_t b, Node nodes, int workers,
+    bool reset, const options_t &opts);
+  ~BasicBufferTree();
   /**
-   * Puts an update into the data structure.
+   * Puts an update into the data structure. Safe to call from many threads
+   * at once, each thread inserts into its own shard of the root.
    * @param upd the edge update.
    * @return nothing.
    */
-  insert_ret_t insert(update_t upd);
+  insert_ret_t insert(record_t upd);
+
+  /**
+   * Puts a block of updates into the data structure. Blocks at least as
+   * large as the root are partitioned directly into level 1.
+   * @param upds the edge updates.
+   * @param n    the number of updates in upds.
+   * @return nothing.
+   */
+  insert_ret_t insert_batch(const record_t *upds, size_t n);
+
+  /**
+   * Puts a block of already serialized updates into the data structure.
+   * @param data the serialized updates (see serialize_update).
+   * @param size the size of data in bytes, a multiple of serial_update_size.
+   * @return nothing.
+   */
+  insert_ret_t insert_serialized(const char *data, size_t size);
+
+  /**
+   * As insert but never waits for consumers to make room for ripe leaves.
+   * Use it to notice when the consumers are falling behind and throttle
+   * whatever produces the updates.
+   * @param upd the edge update.
+   * @return false if the tree is backed up and upd was not inserted.
+   */
+  bool try_insert(record_t upd);
+
+  /**
+   * As insert_batch but never waits for consumers to make room.
+   * @param upds the edge updates.
+   * @param n    the number of updates in upds.
+   * @return the number of updates inserted, always a prefix of upds. Fewer
+   *         than n if the tree is backed up.
+   */
+  size_t try_insert_batch(const record_t *upds, size_t n);
 
   /*
    * Ask the buffer tree for data and sleep if necessary until it is available.
    * @param data       this is where to the key and vector of updates associated with it
+   * @param worker     the caller's id from 0 to consumer_queues - 1. Only used with
+   *                   BufferTreeOptions::consumer_queues, in which case the leaves
+   *                   whose keys this worker owns are returned first.
+   * @param timeout_us how long to wait for data in microseconds. Forever, or
+   *                   until set_non_block, if negative
    * @return           true true if got valid data, false if unable to get data.
    */
-  bool get_data(data_ret_t &data);
+  bool get_data(data_ret_t &data, int worker=0, int64_t timeout_us=-1);
+
+  /*
+   * Ask the buffer tree for data without copying it out of the circular
+   * queue. Sleeps if necessary until data is available.
+   * @param lease      set to the leaf's key and updates, see LeafLease
+   * @param worker     as for get_data
+   * @param timeout_us as for get_data
+   * @return           true if got valid data, false if unable to get data.
+   *                   Only a valid lease must be released.
+   */
+  bool lease_data(lease_t &lease, int worker=0, int64_t timeout_us=-1);
+
+  /*
+   * Return a lease so its queue slot may be reused. The lease's data must
+   * not be accessed afterwards.
+   * @param lease      a lease filled by lease_data
+   */
+  void release_data(lease_t &lease);
+
+  /*
+   * Ask the buffer tree for several ripe leaves at once, sleeping if
+   * necessary until at least one is available. The leaves are claimed from
+   * the circular queue in a single operation.
+   * @param data       set to the key and vector of updates of each leaf
+   * @param max_leaves the most leaves to get
+   * @param max_bytes  the most bytes of updates to get, though at least one
+   *                   leaf is returned however large
+   * @param worker     as for get_data
+   * @param timeout_us as for get_data
+   * @return           true if got valid data, false if unable to get data.
+   */
+  bool get_data_batch(std::vector<data_ret_t> &data, size_t max_leaves, uint64_t max_bytes,
+    int worker=0, int64_t timeout_us=-1);
+
+  /*
+   * As get_data_batch but leases the leaves in place.
+   * @param leases     set to a lease of each leaf, see LeafLease
+   * @return           true if got valid data. Only then must the leases
+   *                   be released, all together with release_data_batch
+   */
+  bool lease_data_batch(std::vector<lease_t> &leases, size_t max_leaves, uint64_t max_bytes,
+    int worker=0, int64_t timeout_us=-1);
+  void release_data_batch(std::vector<lease_t> &leases);
 
   /**
    * Flushes the entire tree down to the leaves.
+   * Must not be called concurrently with insert.
    * @return nothing.
    */
   flush_ret_t force_flush();
@@ -129,20 +573,40 @@ public:
   void set_non_block(bool block);
 
   /*
-   * Function to convert an update_t to a char array
+   * Counters describing the use of the ripe leaf queues, summed across
+   * the queues if there are several.
+   */
+  queue_stats_t get_queue_stats();
+
+  /*
+   * The bytes flushes have written to buffers below the root, leaves
+   * included, as they are stored. Flushes still running are not counted.
+   */
+  uint64_t get_bytes_written();
+
+  /*
+   * Choose the algorithm used to partition data during flushes.
+   * Should not be changed while flushes are in progress.
+   * @param kernel   SCATTER_KERNEL (default) or RADIX_KERNEL
+   * @return         nothing
+   */
+  inline void set_flush_kernel(flush_kernel_t kernel) {flush_kernel = kernel;}
+
+  /*
+   * Function to convert a record to a char array
    * @param   dst the memory location to put the serialized data
    * @param   src the edge update
    * @return  nothing
    */
-  void serialize_update(char *dst, update_t src);
+  void serialize_update(char *dst, record_t src);
 
   /*
-   * Function to covert char array to update_t
+   * Function to covert char array to a record
    * @param src the memory location to load serialized data from
    * @param dst the edge update to put stuff into
    * @return nothing
    */
-  update_t deserialize_update(char *src);
+  record_t deserialize_update(const char *src);
  
   /*
    * Copy the serialized data from one location to another
@@ -150,36 +614,29 @@ public:
    * @param dst data to copy to
    * @return nothing
    */
-  static void copy_serial(char *src, char *dst);
+  static void copy_serial(const char *src, char *dst);
 
   /*
    * Load a key from serialized data
    * @param location data to pull from
    * @return the key pulled from the data
    */
-  static Node load_key(char *location);
+  static Node load_key(const char *location);
 
   /*
    * Creates the entire buffer tree to produce a tree of depth log_B(N)
    */
   void setup_tree();
 
-  /*
-   * Static variables which track universal information about the buffer tree which
-   * we would like to be accesible to all the bufferControlBlocks
-   */
-  static uint page_size;
-  static const uint serial_update_size = sizeof(Node) + sizeof(Node);
-  static uint8_t max_level;
-  static uint32_t buffer_size;
-  static uint64_t backing_EOF;
-  static uint64_t leaf_size;
-  /*
-   * File descriptor of backing file for storage
-   */
-  static int backing_store;
+  // the sizes this tree settled on, such as its leaf_size and page_size
+  inline const TreeConfig &get_config() const {return config;}
+
+  static const uint serial_update_size = Record::size;
 };
 
+typedef BasicBufferTree<NodeRecord> BufferTree;
+typedef BufferTree::data_ret_t data_ret_t;
+
 class BufferFullError : public std::exception {
 private:
   int id;
@@ -200,5 +657,12 @@ public:
   }
 };
 
+class NodeRangeError : public std::exception {
+public:
+  virtual const char * what() const throw() {
+    return "The nodes do not fit in the records of the buffer tree";
+  }
+};
+
 
 #endif //FASTBUFFERTREE_BUFFER_TREE_H
@@ -1,59 +1,162 @@
 #ifndef QUEUE_GUARD
 #define QUEUE_GUARD
 
-#include <condition_variable>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <mutex>
 #include <utility>
+#include <vector>
 
 struct queue_elm {
-	volatile bool dirty;    // is this queue element yet to be processed by sketching (if so do not overwrite)
-	volatile bool touched;  // have we peeked at this item (if so do not peek it again)
-	volatile uint32_t size; // the size of this data element (in bytes)
+	uint32_t size;          // the size of this data element (in bytes)
+	bool borrowed;          // does data point to memory the queue does not own
 	char *data;             // a pointer to the data
 };
 
+// counters describing how a CircularQueue has been used
+struct queue_stats_t {
+	uint64_t producer_blocked_ns; // total time producers spent waiting for room
+	uint64_t producer_blocks;     // number of times a producer had to wait
+	uint64_t depth_bytes;         // the current capacity of the queue
+	uint64_t grows;               // times an adaptive queue grew
+	uint64_t shrinks;             // times an adaptive queue shrank
+};
+
 /*
  * A circular queue of data elements.
  * Used in the bufferTree to place leaf data which is ready to be processed.
  * Has a finite size and will block operations which do not have what they
  * need need (either empty or full for peek and push respectively)
+ *
+ * The queue is a lock free multi producer multi consumer ring. Every slot
+ * has a sequence number which says whose turn it is to use the slot. A
+ * producer may fill slot pos % len once its sequence is pos and a consumer
+ * may peek it once its sequence is pos + 1. pop hands the slot to the
+ * producer of pos + len. Threads which can't make progress spin for a
+ * while and then sleep on a futex until the other side makes some.
+ *
+ * The data of an element lives in a buffer of elm_size bytes taken from a
+ * free list, or for push_ref in memory lent by the producer. The queue's
+ * depth is the number of buffers which may exist plus the number of lent
+ * elements it holds, so lent elements count against it too.
+ * An adaptive queue grows its depth, up to the size of the ring, rather than
+ * make a producer wait and shrinks back towards its starting depth when the
+ * buffers sit unused. Buffers are page aligned, so if elm_size is a multiple
+ * of the page size then they may be filled by O_DIRECT reads.
  */
-
 class CircularQueue {
 public:
-	CircularQueue(int num_elements, int size_of_elm);
+	/*
+	 * @param   num_elements how many elements the queue holds
+	 * @param   size_of_elm the largest element in bytes
+	 * @param   max_elements if larger than num_elements the queue is adaptive
+	 *          and may grow to hold this many elements
+	 */
+	CircularQueue(int num_elements, int size_of_elm, int max_elements=0);
 	~CircularQueue();
 
-	/* 
+	/*
 	 * Add a data element to the queue
 	 * @param   elm the data to be placed into the queue
 	 * @param   size the number of bytes in elm
 	 */
-	void push(char *elm, int size);              
-	
-	/* 
+	void push(char *elm, int size);
+
+	/*
+	 * Add a data element to the queue without copying it. The memory must
+	 * stay valid until the element is popped.
+	 * @param   elm the data to be placed into the queue
+	 * @param   size the number of bytes in elm
+	 */
+	void push_ref(char *elm, int size);
+
+	/*
+	 * As push and push_ref but never wait for room
+	 * @return  false if the queue is full and nothing was pushed
+	 */
+	bool try_push(char *elm, int size);
+	bool try_push_ref(char *elm, int size);
+
+	/*
+	 * Claim the next slot so that a producer can fill it in place. Blocks
+	 * while the queue is full. Consumers wait for the slot to be committed
+	 * so fill it promptly.
+	 * @param   data set to the slot's memory, elm_size bytes
+	 * @return  the slot to pass to commit
+	 */
+	int reserve(char *&data);
+
+	// as reserve but return -1 rather than wait if the queue is full
+	int try_reserve(char *&data);
+
+	/*
+	 * Publish a slot claimed by reserve to consumers
+	 * @param   i is the slot returned by reserve
+	 * @param   size the number of bytes written to the slot
+	 */
+	void commit(int i, int size);
+
+	/*
+	 * Give back a slot claimed by reserve without publishing anything.
+	 * Consumers pass over it.
+	 * @param   i is the slot returned by reserve
+	 */
+	void cancel(int i);
+
+	/*
 	 * Get data from the queue for processing
 	 * @param   ret where the data from the circular queue should be placed
+	 * @param   timeout_us how long to wait for data in microseconds,
+	 *          forever if negative
 	 * @return  true if we were able to get good data, false otherwise
 	 */
-	bool peek(std::pair<int, queue_elm> &ret);
-	
-	/* 
+	bool peek(std::pair<int, queue_elm> &ret, int64_t timeout_us=-1);
+
+	/*
 	 * Mark a queue element as ready to be overwritten.
 	 * Call pop after processing the data from peek.
 	 * @param   i is the position of the queue_elm which should be popped
 	 */
 	void pop(int i);
 
-	std::condition_variable cirq_full;
-	std::mutex write_lock;
+	/*
+	 * Get a run of consecutive data elements from the queue in one go.
+	 * Waits as peek does if the queue is empty.
+	 * @param   ret where the data elements should be placed
+	 * @param   max_elms the most elements to take, ret must have room for them
+	 * @param   max_bytes the most bytes to take, though at least one element
+	 *          is taken however large
+	 * @param   timeout_us as for peek
+	 * @return  the number of elements taken, 0 if unable to get data
+	 */
+	int peek_batch(std::pair<int, queue_elm> *ret, int max_elms, uint64_t max_bytes,
+	  int64_t timeout_us=-1);
 
-	std::condition_variable cirq_empty;
-	std::mutex read_lock;
+	/*
+	 * Pop a run of elements taken by peek_batch
+	 * @param   first the position of the first element in the run
+	 * @param   count the number of elements in the run
+	 */
+	void pop_batch(int first, int count);
 
-	// should CircularQueue peeks wait until they can succeed(false)
-	// or return false on failure (true)
-	volatile bool no_block;
+	/*
+	 * Should peeks wait until they can succeed (false) or return false
+	 * when the queue is empty (true). Wakes any sleeping threads.
+	 * @param   non_block the new setting
+	 */
+	void set_no_block(bool non_block);
+
+	/*
+	 * Place the buffers allocated from now on on a NUMA node, whichever
+	 * thread allocates them. See place_on_numa_node.
+	 * @param   node the node, -1 for no preference
+	 */
+	inline void set_numa_node(int node) {numa_node = node;}
+
+	// counters describing the queue's use so far
+	queue_stats_t get_stats();
 
 	/*
 	 * Function which prints the circular queue
@@ -61,22 +164,111 @@ public:
 	 */
 	void print();
 private:
+	struct Slot {
+		std::atomic<uint64_t> seq; // whose turn it is to use this slot
+		std::atomic<uint32_t> size; // elm.size, which may be read before the slot is claimed
+		queue_elm elm;
+	};
+
+	// an entry of the free list, which is a ring like the queue itself
+	struct FreeSlot {
+		std::atomic<uint64_t> seq;
+		char *buf;
+	};
+
+	// the size of a slot given back by cancel
+	static const uint32_t cancelled_size = UINT32_MAX;
+
 	int len;      // maximum number of data elements to be stored in the queue
 	int elm_size; // size of an individual element in bytes
+	int numa_node; // where buffers are placed, -1 for anywhere
+
+	Slot *slots;            // the ring
+	FreeSlot *free_slots;   // buffers not holding an element
+
+	// producers and consumers each get their own cache line
+	char pad0[64];
+	std::atomic<uint64_t> head; // where to push (write pointer)
+	char pad1[64];
+	std::atomic<uint64_t> tail; // where to peek (read pointer)
+	char pad2[64];
+	std::atomic<uint64_t> free_head;
+	std::atomic<uint64_t> free_tail;
+	char pad3[64];
+
+	// futex words bumped whenever data is pushed or a slot is popped, and
+	// the number of threads sleeping on each
+	std::atomic<uint32_t> data_epoch;
+	std::atomic<uint32_t> data_waiters;
+	char pad4[64];
+	std::atomic<uint32_t> space_epoch;
+	std::atomic<uint32_t> space_waiters;
+	char pad5[64];
+
+	// should CircularQueue peeks wait until they can succeed(false)
+	// or return false on failure (true)
+	std::atomic<bool> no_block;
 
-	int head;     // where to push (starts at 0, write pointer)
-	int tail;     // where to peek (starts at 0, read pointer)
-	
-	queue_elm *queue_array; // array queue_elm metadata
-	char *data_array;       // the actual data
+	// the depth of the queue, how many buffers exist and how many lent
+	// elements it holds
+	std::atomic<uint32_t> depth;
+	std::atomic<uint32_t> allocated;
+	std::atomic<uint32_t> lent;
+	uint32_t min_depth;     // the depth the queue was created with
+	bool adaptive;
+	std::atomic<uint32_t> in_use;      // buffers and lent memory holding an element
+	std::atomic<uint32_t> peak_in_use; // since the queue last considered shrinking
+	std::atomic<bool> blocked_recently;
+	std::atomic<int64_t> last_adapt_ns;
+	static const int64_t adapt_interval_ns = 100 * 1000 * 1000;
 
-	// increment the head or tail pointer
-	inline int incr(int p) {return (p + 1) % len;}
+	std::atomic<uint64_t> blocked_ns;
+	std::atomic<uint64_t> blocks;
+	std::atomic<uint64_t> grows;
+	std::atomic<uint64_t> shrinks;
+
+	std::vector<char *> all_buffers; // so they can be freed
+	std::mutex alloc_lock;           // guards all_buffers
+
+	// add an element, copying it into the queue unless borrow is set.
+	// Returns false if the queue is full and may_block is not set
+	bool push_elm(char *elm, int size, bool borrow, bool may_block);
+	int reserve_slot(char *&data, bool may_block);
+
+	// claim the next slot for a producer, setting pos to its position.
+	// Returns false if the ring is full and may_block is not set
+	bool claim(uint64_t &pos, bool may_block);
+
+	// get a buffer for an element, growing or waiting if none is free.
+	// nullptr if none is free and may_block is not set
+	char *get_buffer(bool may_block);
+	void put_buffer(char *buf);
+	// take room in the depth for a lent element, freeing an unused buffer,
+	// growing or waiting if there is none. false if may_block is not set and
+	// there is no room
+	bool get_lent(bool may_block);
+	void put_lent();
+	char *new_buffer();
+	void delete_buffer(char *buf);
+	bool free_push(char *buf);
+	char *free_pop();
+	bool free_empty();
+
+	// grow the queue's depth if it is adaptive and may grow
+	bool grow();
+	// shrink the queue's depth if it has been underused for a while
+	void maybe_shrink();
 
 	// functions for checking if the queue is empty or full
-	inline bool full()     {return queue_array[head].dirty;} // if the next data item is dirty then full
-	// if place to read from is clean and has not been peeked already then queue is empty
-	inline bool empty()    {return !queue_array[tail].dirty || queue_array[tail].touched;}
+	bool full();
+	bool empty();
+
+	// spin for a while then sleep until ready(), until woken or for at
+	// most timeout_us if it is not negative
+	template <class Ready>
+	void wait(std::atomic<uint32_t> &epoch, std::atomic<uint32_t> &waiters, Ready ready,
+	  int64_t timeout_us=-1);
+	void wake(std::atomic<uint32_t> &epoch, std::atomic<uint32_t> &waiters, int count=1);
 };
 
 class WriteTooBig : public std::exception {
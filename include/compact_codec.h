@@ -0,0 +1,63 @@
+#ifndef FASTBUFFERTREE_COMPACT_CODEC_H
+#define FASTBUFFERTREE_COMPACT_CODEC_H
+
+#include <cstdint>
+#include <cstddef>
+#include "update.h"
+
+/*
+ * The compact encoding of updates written to the backing store.
+ * Every write to a buffer is one block. A block begins with a varint holding
+ * the number of updates n and a flag in its lowest bit. The updates of the
+ * block are sorted. Without the flag each update is a varint of its source's
+ * delta from the previous update followed by a varint of its destination,
+ * which is a delta from the previous destination if the source did not
+ * change, and then its payload as is. Leaves hold a single key so their
+ * updates have no source.
+ * If this would be no smaller than the updates themselves the flag is set
+ * and the updates are stored as is, without sources in leaves.
+ */
+
+// the most bytes a block adds to the updates it holds
+static const uint32_t max_block_header = 10;
+
+/*
+ * Sort serialized updates with an LSD radix sort a byte at a time. The
+ * histograms of every byte are built in a single pass and bytes which are
+ * the same for every update are skipped, so small node ids need only a few
+ * passes. Instantiated for the records in update.h.
+ * @param data        the updates to sort
+ * @param n           the number of updates
+ * @param by_source   sort by source and then destination rather than only
+ *                    by destination
+ * @param by_payload  break ties on the payload, so that identical updates
+ *                    end up next to each other
+ */
+template <class Record>
+void radix_sort_records(char *data, size_t n, bool by_source, bool by_payload);
+
+/*
+ * Encode serialized updates as a single block.
+ * @param data  the updates, which are sorted in place
+ * @param n     the number of updates
+ * @param leaf  do the updates all have the same source
+ * @param out   where the block is written, at least
+ *              n * Record::size + max_block_header bytes
+ * @return      the size of the block in bytes
+ */
+template <class Record>
+uint32_t encode_records(char *data, size_t n, bool leaf, char *out);
+
+/*
+ * Decode a sequence of blocks back into serialized updates.
+ * @param in    the blocks
+ * @param size  the size of the blocks in bytes
+ * @param leaf  were the blocks encoded as a leaf
+ * @param key   the source of every update if leaf
+ * @param out   where the updates are written
+ * @return      the size of the updates in bytes
+ */
+template <class Record>
+uint32_t decode_records(const char *in, uint32_t size, bool leaf, Node key, char *out);
+
+#endif //FASTBUFFERTREE_COMPACT_CODEC_H
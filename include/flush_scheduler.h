@@ -0,0 +1,61 @@
+#ifndef FASTBUFFERTREE_FLUSH_SCHEDULER_H
+#define FASTBUFFERTREE_FLUSH_SCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> flush_task_t;
+
+/*
+ * A pool of worker threads which carry out flushes in the background.
+ * Flushes of root buffers and of BufferControlBlocks that are ready to be
+ * flushed are placed in a FIFO work queue, from which the workers pick tasks.
+ */
+class FlushScheduler {
+public:
+  /*
+   * Starts the worker threads
+   * @param num_threads the number of workers performing flushes
+   * @param on_start    run by each worker before it takes any flushes, for
+   *                    instance to pin it to some CPUs. May be nullptr
+   */
+  FlushScheduler(int num_threads, flush_task_t on_start=nullptr);
+
+  /*
+   * Finishes any remaining tasks and then joins the workers
+   */
+  ~FlushScheduler();
+
+  /*
+   * Add a flush to the work queue
+   * @param task   the flush to perform
+   * @return       nothing
+   */
+  void submit(flush_task_t task);
+
+  /*
+   * Wait until the work queue is empty and no worker is performing a flush.
+   * Tasks submitted concurrently with this call may or may not be waited on.
+   * @return nothing
+   */
+  void wait_idle();
+
+private:
+  std::vector<std::thread> workers;
+  std::deque<flush_task_t> tasks;
+
+  std::mutex lock;                // guards all of the below
+  std::condition_variable work;   // signaled when tasks are added or on shutdown
+  std::condition_variable idle;   // signaled when the last running task finishes
+  int running;                    // number of tasks currently being performed
+  bool shutdown;
+
+  // main loop of a worker thread
+  void do_work(flush_task_t on_start);
+};
+
+#endif //FASTBUFFERTREE_FLUSH_SCHEDULER_H
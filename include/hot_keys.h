@@ -0,0 +1,93 @@
+#ifndef FASTBUFFERTREE_HOT_KEYS_H
+#define FASTBUFFERTREE_HOT_KEYS_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "update.h"
+
+/*
+ * The hot keys and their slots, in an open addressing table which is cheap
+ * to look up and to copy. Threads may keep a copy to look up without a lock.
+ */
+class HotSet {
+public:
+  // the slot of key if it is hot, otherwise -1
+  inline int32_t find(Node key) const {
+    if (table.empty()) return -1;
+    for (uint32_t i = hash(key) & mask; table[i].slot >= 0; i = (i + 1) & mask) {
+      if (table[i].key == key) return table[i].slot;
+    }
+    return -1;
+  }
+
+private:
+  friend class HotKeys;
+  struct Entry {
+    Node key;
+    int32_t slot; // -1 if the entry is empty
+  };
+  std::vector<Entry> table;
+  uint32_t mask = 0;
+
+  static inline uint32_t hash(Node key) {
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+  void insert(Node key, int32_t slot);
+};
+
+/*
+ * Tracks which keys receive the most updates. Keys are sampled as root
+ * buffers are flushed and once enough samples have been taken the k most
+ * frequent keys become hot. Each hot key owns a slot from 0 to k-1 which it
+ * keeps for as long as it stays hot.
+ * Not thread safe, the caller must synchronize access.
+ */
+class HotKeys {
+public:
+  /*
+   * @param k       the number of hot keys
+   * @param refresh how many samples to take before choosing the hot keys again
+   */
+  HotKeys(uint32_t k, uint64_t refresh);
+
+  // the slot of key if it is hot, otherwise -1
+  inline int32_t find(Node key) const {return set.find(key);}
+
+  // count n samples of key. Returns true once the hot keys should be chosen again
+  inline bool sample(Node key, uint64_t n=1) {
+    counts[key] += n;
+    samples += n;
+    return samples >= refresh_samples;
+  }
+
+  /*
+   * Choose the hot keys from the samples taken so far. Counts decay by half
+   * so the hot keys follow changes in the stream.
+   * @param evicted  set to the slots of keys which are no longer hot, along
+   *                 with the key each slot held
+   */
+  void refresh(std::vector<std::pair<uint32_t, Node>> &evicted);
+
+  inline uint32_t size() const {return k;}
+  // the key which owns a slot, only meaningful if in_use(slot)
+  inline Node key_of(uint32_t slot) const {return slot_keys[slot];}
+  inline bool in_use(uint32_t slot) const {return slot_used[slot];}
+
+  // the current hot keys, and how many times they have been chosen
+  inline const HotSet &hot_set() const {return set;}
+  inline uint64_t generation() const {return refreshes;}
+
+private:
+  uint32_t k;
+  uint64_t refresh_samples;
+  uint64_t samples;
+  uint64_t refreshes;
+  std::unordered_map<Node, uint64_t> counts;
+
+  HotSet set;
+  std::vector<Node> slot_keys;
+  std::vector<bool> slot_used;
+};
+
+#endif //FASTBUFFERTREE_HOT_KEYS_H
@@ -0,0 +1,32 @@
+#ifndef FASTBUFFERTREE_NUMA_BINDING_H
+#define FASTBUFFERTREE_NUMA_BINDING_H
+
+#include <cstddef>
+
+/*
+ * Keep threads, and the memory they touch, on a single NUMA node. The
+ * topology is read from sysfs and the kernel is asked directly, so no
+ * NUMA library is needed. On machines without NUMA there is one node.
+ */
+
+// the number of NUMA nodes, at least 1
+int numa_node_count();
+
+/*
+ * Pin the calling thread to the CPUs of a NUMA node and have the pages it
+ * first touches placed on that node where possible.
+ * @param node   the node, from 0 to numa_node_count() - 1
+ * @return       false if the thread could not be pinned
+ */
+bool bind_to_numa_node(int node);
+
+/*
+ * Have the pages of a region placed on a NUMA node where possible, whichever
+ * thread first touches them. Call before the region is first touched.
+ * @param mem    the region, page aligned
+ * @param size   the size of the region in bytes
+ * @param node   the node, from 0 to numa_node_count() - 1
+ */
+void place_on_numa_node(void *mem, size_t size, int node);
+
+#endif //FASTBUFFERTREE_NUMA_BINDING_H
@@ -0,0 +1,127 @@
+#ifndef FASTBUFFERTREE_SHARDED_BUFFER_TREE_H
+#define FASTBUFFERTREE_SHARDED_BUFFER_TREE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "buffer_tree.h"
+
+/*
+ * A front-end which splits the keys [0, N) into P contiguous ranges and gives
+ * each range a BufferTree of its own. Every shard has its own root, backing
+ * file, flush workers and queues, so shards never contend with one another.
+ * Shards are spread over the NUMA nodes, their flush workers pinned to the
+ * node and the shard built on it so its memory is placed there too. Root
+ * shards and queue buffers, which are allocated later by producers and
+ * flush workers, are placed on the node explicitly.
+ * Updates are routed to their shard by key and consumers take leaves from
+ * every shard, starting with a home shard chosen by their worker id.
+ */
+template <class Record>
+class BasicShardedBufferTree {
+public:
+  typedef BasicBufferTree<Record> tree_t;
+  typedef typename tree_t::record_t record_t;
+  typedef typename tree_t::lease_t lease_t;
+  typedef typename tree_t::options_t options_t;
+  typedef typename tree_t::data_ret_t data_ret_t;
+
+private:
+  std::vector<tree_t*> shards;
+  ChildRouter router; // how keys map to shards, as keys map to children
+
+  std::atomic<bool> non_block; // should taking leaves return when none are left
+  static const int steal_poll_us = 1000; // how often an idle consumer looks at other shards
+
+  // the shard a consumer takes leaves from first, and the worker id it has there
+  inline uint32_t home_shard(int worker) const {return worker % shards.size();}
+  inline int shard_worker(int worker) const {return worker / shards.size();}
+
+public:
+  /**
+   * Generates a sharded buffer tree.
+   * @param dir     prefix of the shards' directories. Shard i is stored under
+   *                dir + "shard<i>_", which may be a directory of its own.
+   * @param num_shards the number of key ranges P, at most nodes / max(2, b)
+   *                so that every shard has a key for each child of its root
+   * @param numa    spread the shards over the NUMA nodes, shard i on node
+   *                i % numa_node_count(). This overrides opts.numa_node
+   * @param opts    the settings of every shard, see BufferTreeOptions.
+   *                opts.first_key is ignored. Leaves are sized for all of
+   *                the nodes unless opts.graph_nodes says otherwise
+   * Other parameters as for BufferTree. workers is split between the shards.
+   */
+  BasicShardedBufferTree(std::string dir, uint32_t size, uint32_t b, Node nodes, int workers,
+    bool reset, int num_shards, bool numa, const options_t &opts);
+  ~BasicShardedBufferTree();
+
+  // the shard responsible for key
+  inline uint32_t shard_of(Node key) const {return router.route(key);}
+  inline uint32_t num_shards() const {return shards.size();}
+  inline tree_t *get_tree(uint32_t shard) {return shards[shard];}
+
+  /**
+   * Puts an update into the shard responsible for its key. Safe to call
+   * from many threads at once.
+   * @param upd the edge update.
+   * @return nothing.
+   */
+  insert_ret_t insert(record_t upd);
+
+  /**
+   * Puts a block of updates into the data structure, partitioned into one
+   * block per shard.
+   * @param upds the edge updates.
+   * @param n    the number of updates in upds.
+   * @return nothing.
+   */
+  insert_ret_t insert_batch(const record_t *upds, size_t n);
+
+  /**
+   * As insert but never waits for consumers, see BufferTree::try_insert.
+   * @return false if the update's shard is backed up and upd was not inserted.
+   */
+  bool try_insert(record_t upd);
+
+  /*
+   * Ask the shards for data and sleep if necessary until it is available.
+   * Leaves of the worker's home shard are returned first.
+   * @param data       set to the key and vector of updates of a leaf
+   * @param worker     the caller's id, consumers should be numbered from 0
+   * @return           true if got valid data, false if unable to get data.
+   */
+  bool get_data(data_ret_t &data, int worker=0);
+
+  /*
+   * As BufferTree::get_data_batch, the leaves all come from a single shard.
+   */
+  bool get_data_batch(std::vector<data_ret_t> &data, size_t max_leaves, uint64_t max_bytes,
+    int worker=0);
+
+  /*
+   * As get_data but leases the leaf in place, see LeafLease.
+   * Only a valid lease must be released with release_data.
+   */
+  bool lease_data(lease_t &lease, int worker=0);
+  void release_data(lease_t &lease);
+
+  /**
+   * Flushes every shard down to its leaves, the shards in parallel.
+   * Must not be called concurrently with insert.
+   * @return nothing.
+   */
+  flush_ret_t force_flush();
+
+  // see BufferTree::set_non_block
+  void set_non_block(bool block);
+
+  // queue counters summed across the shards
+  queue_stats_t get_queue_stats();
+
+  // see BufferTree::set_flush_kernel
+  void set_flush_kernel(flush_kernel_t kernel);
+};
+
+typedef BasicShardedBufferTree<NodeRecord> ShardedBufferTree;
+
+#endif //FASTBUFFERTREE_SHARDED_BUFFER_TREE_H
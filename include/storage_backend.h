@@ -0,0 +1,216 @@
+#ifndef FASTBUFFERTREE_STORAGE_BACKEND_H
+#define FASTBUFFERTREE_STORAGE_BACKEND_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+typedef uint64_t File_Pointer;
+
+// ways in which the backing store may be accessed
+enum storage_t {
+  FILE_STORAGE,  // pread and pwrite
+  URING_STORAGE, // io_uring, falling back to FILE_STORAGE if unavailable
+  MEMORY_STORAGE, // an arena in RAM, for trees which fit in memory
+  MMAP_STORAGE    // the backing file mapped into memory
+};
+
+// how a region of the backing store is expected to be accessed
+enum access_hint_t {
+  ACCESS_HOT,        // small and touched constantly, keep it resident
+  ACCESS_SEQUENTIAL, // whole buffers written then read back in order
+  ACCESS_RANDOM      // touched a little at a time, don't read ahead
+};
+
+// a single write to the backing store, performed as part of a batch
+struct write_req_t {
+  const char *data;
+  uint32_t size;
+  File_Pointer offset;
+};
+
+/*
+ * Interface through which BufferControlBlocks and flushes access the data
+ * of non-root buffers. Implementations must allow concurrent calls.
+ */
+class StorageBackend {
+public:
+  virtual ~StorageBackend() {}
+
+  /*
+   * Write data to the backing store
+   * @param data    the data to write
+   * @param size    the number of bytes to write
+   * @param offset  where in the backing store to write to
+   */
+  virtual void write(const char *data, uint32_t size, File_Pointer offset) = 0;
+
+  /*
+   * Read data from the backing store
+   * @param data    where to put the data
+   * @param size    the number of bytes to read
+   * @param offset  where in the backing store to read from
+   */
+  virtual void read(char *data, uint32_t size, File_Pointer offset) = 0;
+
+  /*
+   * Perform a number of writes, returning once they have all completed.
+   * @param reqs    the writes to perform
+   * @param num     the number of writes in reqs
+   */
+  virtual void write_batch(write_req_t *reqs, size_t num) {
+    for (size_t i = 0; i < num; i++)
+      write(reqs[i].data, reqs[i].size, reqs[i].offset);
+  }
+
+  // does write_batch do better than a write per request
+  virtual bool batches_writes() {return false;}
+
+  /*
+   * Reserve space for the entire backing store up front
+   * @param size    the size of the backing store in bytes
+   */
+  virtual void allocate(File_Pointer size) = 0;
+
+  /*
+   * Backing stores held in memory may be accessed in place
+   * @param offset  a location in the backing store
+   * @return        a pointer to that location, or nullptr if the backing
+   *                store must be accessed through read and write
+   */
+  virtual char *data_at(File_Pointer offset) {(void) offset; return nullptr;}
+
+  /*
+   * Tell the backing store how a region will be used. Must be called after
+   * allocate. Ignored by backing stores that don't benefit.
+   * @param offset  start of the region
+   * @param size    size of the region in bytes
+   * @param hint    the expected access pattern
+   */
+  virtual void advise(File_Pointer offset, File_Pointer size, access_hint_t hint) {
+    (void) offset; (void) size; (void) hint;
+  }
+};
+
+/*
+ * Backing store held in a single file accessed with pread and pwrite.
+ * If opened with O_DIRECT then IO bypasses the page cache. The kernel then
+ * requires page aligned offsets, sizes and memory, so unaligned requests are
+ * widened to whole pages through a per thread bounce buffer. A write which
+ * begins part way through a page first reads that page back in so the data
+ * before it is kept.
+ */
+class FileBackend : public StorageBackend {
+public:
+  /*
+   * Opens the file, exiting upon failure. If the file system does not
+   * support O_DIRECT then the file is opened without it.
+   * @param file_name   path of the file
+   * @param flags       flags to open the file with
+   */
+  FileBackend(std::string file_name, int flags);
+  ~FileBackend();
+
+  void write(const char *data, uint32_t size, File_Pointer offset) override;
+  void read(char *data, uint32_t size, File_Pointer offset) override;
+  void allocate(File_Pointer size) override;
+
+  // is the page cache bypassed
+  bool is_direct() {return direct;}
+
+protected:
+  int fd;
+  bool direct;    // opened with O_DIRECT
+  uint32_t align; // alignment of O_DIRECT requests
+
+private:
+  // pwrite and pread exactly size bytes, exiting upon failure
+  void write_all(const char *data, uint32_t size, File_Pointer offset);
+  void read_all(char *data, uint32_t size, File_Pointer offset);
+};
+
+/*
+ * Backing store file mapped into memory. Reads and writes are memcpys to
+ * and from the mapping, the data may be accessed in place, and the kernel
+ * writes dirty pages back to the file.
+ */
+class MmapBackend : public FileBackend {
+public:
+  MmapBackend(std::string file_name, int flags);
+  ~MmapBackend();
+
+  void write(const char *data, uint32_t size, File_Pointer offset) override;
+  void read(char *data, uint32_t size, File_Pointer offset) override;
+  void allocate(File_Pointer size) override;
+  char *data_at(File_Pointer offset) override {return map + offset;}
+  void advise(File_Pointer offset, File_Pointer size, access_hint_t hint) override;
+
+private:
+  char *map;
+  File_Pointer map_len;
+};
+
+/*
+ * Backing store held entirely in a RAM arena. Reads and writes are memcpys
+ * and the data may be accessed in place. Nothing is written to disk.
+ */
+class MemoryBackend : public StorageBackend {
+public:
+  MemoryBackend() : arena(nullptr) {}
+  ~MemoryBackend();
+
+  void write(const char *data, uint32_t size, File_Pointer offset) override;
+  void read(char *data, uint32_t size, File_Pointer offset) override;
+  void allocate(File_Pointer size) override;
+  char *data_at(File_Pointer offset) override {return arena + offset;}
+
+private:
+  char *arena;
+};
+
+class FlushScheduler;
+
+/*
+ * Backing store striped across several devices, each a backing store of its
+ * own such as a file in a directory on its own drive. The offsets of the
+ * backing store are split into one contiguous region per device, so every
+ * buffer lives on a single device. Each device has its own I/O thread and the
+ * writes of a batch which span devices are made on all of them at once.
+ */
+class StripedBackend : public StorageBackend {
+public:
+  // takes ownership of the devices
+  explicit StripedBackend(std::vector<StorageBackend*> devices);
+  ~StripedBackend();
+
+  /*
+   * Split the backing store between the devices. Must be called before allocate.
+   * @param starts  starts[d] is the first offset held by device d. starts[0]
+   *                is 0 and the starts increase
+   */
+  void set_regions(const std::vector<File_Pointer> &starts);
+
+  void write(const char *data, uint32_t size, File_Pointer offset) override;
+  void read(char *data, uint32_t size, File_Pointer offset) override;
+  void write_batch(write_req_t *reqs, size_t num) override;
+  bool batches_writes() override;
+  void allocate(File_Pointer size) override;
+  void advise(File_Pointer offset, File_Pointer size, access_hint_t hint) override;
+
+  inline size_t num_devices() const {return devices.size();}
+
+private:
+  std::vector<StorageBackend*> devices;
+  std::vector<File_Pointer> starts;
+  std::vector<FlushScheduler*> io_queues; // one I/O thread per device
+
+  // the device holding offset. Requests never span devices
+  inline size_t device_of(File_Pointer offset) const {
+    size_t d = devices.size() - 1;
+    while (starts[d] > offset) d--;
+    return d;
+  }
+};
+
+#endif //FASTBUFFERTREE_STORAGE_BACKEND_H
@@ -5,9 +5,74 @@
 #ifndef FASTBUFFERTREE_UPDATE_H
 #define FASTBUFFERTREE_UPDATE_H
 
+#include <cstdint>
+#include <cstring>
 #include <utility>
 typedef uint64_t Node;
 typedef std::pair<Node,Node> update_t;
 
+/*
+ * Describes the updates a BufferTree holds. An update is a key, the source
+ * node whose leaf the update ends up in, and a value which begins with the
+ * update's destination node. Anything after the destination is payload
+ * which the tree carries along untouched, such as a weight.
+ * Updates are serialized as the key followed by the value, so Value must
+ * be trivially copyable and have no padding.
+ * @param Key      unsigned integer type of keys
+ * @param Value    type of values
+ * @param DstSize  the size in bytes of the destination at the start of
+ *                 Value, which is a little endian unsigned integer
+ */
+template <typename Key, typename Value, uint32_t DstSize = sizeof(Value)>
+struct RecordTraits {
+  typedef Key key_t;
+  typedef Value value_t;
+  typedef std::pair<Key, Value> record_t;
+
+  static const uint32_t key_size   = sizeof(Key);
+  static const uint32_t value_size = sizeof(Value);
+  static const uint32_t dst_size   = DstSize;
+  static const uint32_t size       = key_size + value_size; // serialized size of an update
+  // is a record_t laid out as it is serialized, so spans need no conversion
+  static const bool packed = sizeof(record_t) == size;
+
+  static_assert(DstSize <= sizeof(Node) && DstSize <= sizeof(Value), "destinations are at most a Node");
+
+  static inline void serialize(char *dst, const record_t &src) {
+    memcpy(dst, &src.first, key_size);
+    memcpy(dst + key_size, &src.second, value_size);
+  }
+  static inline record_t deserialize(const char *src) {
+    record_t dst;
+    memcpy(&dst.first, src, key_size);
+    memcpy(&dst.second, src + key_size, value_size);
+    return dst;
+  }
+  static inline Node load_key(const char *src) {
+    Key key;
+    memcpy(&key, src, key_size);
+    return key;
+  }
+  static inline value_t load_value(const char *src) {
+    value_t value;
+    memcpy(&value, src + key_size, value_size);
+    return value;
+  }
+  static inline Node load_dst(const char *src) {
+    Node dst = 0;
+    memcpy(&dst, src + key_size, dst_size);
+    return dst;
+  }
+};
+
+// a destination with a weight, for weighted graph streams
+struct WeightedEdge {
+  uint32_t dst;
+  float weight;
+};
+
+typedef RecordTraits<Node, Node> NodeRecord;         // 16 bytes, an update_t
+typedef RecordTraits<uint32_t, uint32_t> Node32Record; // 8 bytes, for fewer than 2^32 nodes
+typedef RecordTraits<uint32_t, WeightedEdge, sizeof(uint32_t)> WeightedRecord; // 12 bytes
 
 #endif //FASTBUFFERTREE_UPDATE_H
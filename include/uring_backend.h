@@ -0,0 +1,67 @@
+#ifndef FASTBUFFERTREE_URING_BACKEND_H
+#define FASTBUFFERTREE_URING_BACKEND_H
+
+#include <mutex>
+#include <vector>
+#include "storage_backend.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+/*
+ * Backing store file whose batched writes are submitted to the kernel
+ * through io_uring, one system call per batch rather than one per write.
+ * Single reads and writes still use pread and pwrite. In O_DIRECT mode the
+ * writes of a batch are rarely page aligned, so they are made one at a time.
+ *
+ * write_batch returns only once every write of the batch has completed. The
+ * writes of a batch are in flight together, but reaping is not deferred to
+ * a later batch: the children written to stay locked until their data is
+ * in the file, so a flush of a child never reads it back before the write
+ * lands, and the flush's scratch buffers may be reused as soon as it returns.
+ * Flushes overlap with one another through the flush workers instead.
+ */
+class UringBackend : public FileBackend {
+public:
+  UringBackend(std::string file_name, int flags);
+  ~UringBackend();
+
+  void write_batch(write_req_t *reqs, size_t num) override;
+  bool batches_writes() override {return !direct;}
+
+  // can io_uring be used on this system
+  static bool available();
+
+private:
+  /*
+   * An io_uring instance. A ring has a single submitter so concurrent
+   * batches each check out their own ring.
+   */
+  struct Ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    iovec *iovecs;        // the buffers of the writes in flight
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+  };
+
+  static const unsigned ring_entries = 256;
+
+  std::vector<Ring*> free_rings;
+  std::mutex ring_lock; // guards free_rings
+
+  static Ring *create_ring(unsigned entries);
+  static void destroy_ring(Ring *ring);
+  Ring *checkout_ring();
+  void return_ring(Ring *ring);
+
+  // submit up to ring->entries writes and wait for all of them to complete
+  void submit_and_wait(Ring *ring, write_req_t *reqs, size_t num);
+};
+
+#endif //FASTBUFFERTREE_URING_BACKEND_H
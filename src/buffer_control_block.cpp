@@ -3,48 +3,60 @@
 //
 
 #include "../include/buffer_control_block.h"
-#include "../include/buffer_tree.h"
 
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
 
-BufferControlBlock::BufferControlBlock(buffer_id_t id, File_Pointer off, uint8_t level)
-  : id(id), file_offset(off), level(level){
+void ChildRouter::init(Node min, Node max, uint16_t num_children) {
+	Node total   = max - min + 1;
+	min_key      = min;
+	options      = num_children;
+	small_width  = total / options;
+	big_width    = small_width + 1;
+	larger_kids  = total % options;
+	larger_count = larger_kids * big_width;
+	small_recip  = reciprocal(small_width);
+	big_recip    = reciprocal(big_width);
+}
+
+BufferControlBlock::BufferControlBlock(buffer_id_t id, File_Pointer off, uint8_t level,
+  const TreeConfig *config) : id(id), config(config), file_offset(off), level(level),
+  flush_queued(false) {
   storage_ptr = 0;
+  raw_ptr = 0;
 }
 
-inline bool BufferControlBlock::needs_flush() {
+bool BufferControlBlock::needs_flush() {
 	if(is_leaf())
-		return storage_ptr >= BufferTree::leaf_size;
+		return raw_ptr >= config->leaf_size;
 	else
-		return storage_ptr >= BufferTree::buffer_size;
+		return raw_ptr >= config->buffer_size;
 }
 
-bool BufferControlBlock::write(char *data, uint32_t size) {
+write_ret_t BufferControlBlock::write(const char *data, uint32_t size, uint32_t raw_size) {
 	// printf("Writing to buffer %d data pointer = %p with size %i\n", id, data, size);
-	if (is_leaf() && storage_ptr + size > BufferTree::leaf_size + BufferTree::page_size) {
-		printf("buffer %i too full [leaf] write size %u\n", id, size);
-		throw BufferFullError(id);
-	}
-	else if(storage_ptr + size > BufferTree::buffer_size + BufferTree::page_size) {
-		printf("buffer %i too full [internal node] write size %u\n", id, size);
-		throw BufferFullError(id);
-	}
-
-	int len = pwrite(BufferTree::backing_store, data, size, file_offset + storage_ptr);
-	int w = 0;
-	while(len < (int32_t)size) {
-		if (len == -1) {
-			printf("ERROR: write to buffer %i failed %s\n", id, strerror(errno));
-			exit(EXIT_FAILURE);
-		}
-		w += len;
-		size -= len;
-		len = pwrite(BufferTree::backing_store, data + w, size, file_offset + storage_ptr + w);
-	}
-	storage_ptr += size;
+	std::lock_guard<std::mutex> lk(mtx);
+	File_Pointer off;
+	if (!reserve(size, off, raw_size))
+		return WRITE_FULL;
+
+	config->backing_store->write(data, size, off);
 
 	// return if this buffer should be added to the flush queue
-	return needs_flush();
+	return needs_flush()? WRITE_NEEDS_FLUSH : WRITE_OK;
+}
+
+bool BufferControlBlock::reserve(uint32_t size, File_Pointer &off, uint32_t raw_size) {
+	// another writer may have filled us since we were last flushed
+	// so it is up to the caller to flush and try again. Compact buffers
+	// have a page to spare for encodings which don't shrink the data
+	File_Pointer capacity = is_leaf()? config->leaf_size + config->page_size
+	                                 : config->buffer_capacity;
+	if (raw_ptr + raw_size > capacity)
+		return false;
+	if (storage_ptr + size > capacity + (config->compact? config->page_size : 0))
+		return false;
+
+	off = file_offset + storage_ptr;
+	storage_ptr += size;
+	raw_ptr += raw_size;
+	return true;
 }
@@ -1,113 +1,231 @@
 #include "../include/buffer_tree.h"
+#include "../include/uring_backend.h"
+#include "../include/compact_codec.h"
+#include "../include/numa_binding.h"
 
 #include <utility>
+#include <algorithm>
 #include <unistd.h> //sysconf
 #include <string.h> //memcpy
-#include <fcntl.h>  //posix_fallocate
-#include <errno.h>
+#include <fcntl.h>
 
-/*
- * Static "global" BufferTree variables
- */
-uint     BufferTree::page_size;
-uint8_t  BufferTree::max_level;
-uint32_t BufferTree::buffer_size;
-uint64_t BufferTree::backing_EOF;
-uint64_t BufferTree::leaf_size;
-int      BufferTree::backing_store;
+// lets threads cache their root shard across trees of every record type
+static std::atomic<uint64_t> next_tree_id(1);
+
+// set while a non-blocking insert flushes the root, so that ripe leaves
+// are parked rather than waited on
+static thread_local bool park_leaves = false;
 
 
+// allocate whole pages, aligned so they can be handed to an O_DIRECT backing store as is
+static char *alloc_pages(uint64_t size, uint32_t page) {
+	void *mem;
+	size += (page - size % page) % page;
+	if (posix_memalign(&mem, page, size) != 0) {
+		printf("ERROR: failed to allocate %lu bytes\n", size);
+		exit(EXIT_FAILURE);
+	}
+	return (char *) mem;
+}
+
+template <class Record>
+static BasicBufferTreeOptions<Record> flush_worker_options(int flush_workers) {
+	BasicBufferTreeOptions<Record> opts;
+	opts.flush_workers = flush_workers;
+	return opts;
+}
+
 /*
  * Constructor
  * Sets up the buffer tree given the storage directory, buffer size, number of children
  * and the number of nodes we will insert(N)
- * We assume that node indices begin at 0 and increase to N-1
+ * We assume that node indices begin at first_key (0 by default) and increase
+ * to first_key + N-1
+ * Throws NodeRangeError if those keys do not fit in the keys of a Record
  */
-BufferTree::BufferTree(std::string dir, uint32_t size, uint32_t b, Node
-nodes, int workers, bool reset=false) : dir(dir), M(size), B(b), N(nodes) {
-	page_size = sysconf(_SC_PAGE_SIZE); // works on POSIX systems (alternative is boost)
-	int file_flags = O_RDWR | O_CREAT; // direct memory O_DIRECT may or may not be good
+template <class Record>
+BasicBufferTree<Record>::BasicBufferTree(std::string dir, uint32_t size, uint32_t b, Node
+nodes, int workers, bool reset, int flush_workers) : 
+  BasicBufferTree(dir, size, b, nodes, workers, reset, flush_worker_options<Record>(flush_workers)) {}
+
+template <class Record>
+BasicBufferTree<Record>::BasicBufferTree(std::string dir, uint32_t size, uint32_t b, Node
+nodes, int workers, bool reset, const options_t &opts) : 
+  BasicBufferTree(std::vector<std::string>{dir}, size, b, nodes, workers, reset, opts) {}
+
+template <class Record>
+BasicBufferTree<Record>::BasicBufferTree(std::vector<std::string> dirs, uint32_t size, uint32_t b,
+Node nodes, int workers, bool reset, const options_t &opts) : dirs(dirs), M(size), B(b), N(nodes),
+  first_key(opts.first_key) {
+	// every key, and every destination, must fit in the records' fields. As
+	// with the 64 bit records, the nodes are fewer than the field can count
+	const uint64_t key_limit = (Record::key_size < sizeof(Node))? 1ull << (8 * Record::key_size) : 0;
+	const uint64_t dst_limit = (Record::dst_size < sizeof(Node))? 1ull << (8 * Record::dst_size) : 0;
+	if (key_limit > 0 && (N >= key_limit || first_key > key_limit - N)) {
+		printf("ERROR: %lu nodes from key %lu are too many for %u byte keys\n", N, first_key,
+		  Record::key_size);
+		throw NodeRangeError();
+	}
+	if (dst_limit > 0 && opts.graph_nodes >= dst_limit) {
+		printf("ERROR: %lu graph nodes are too many for %u byte destinations\n", opts.graph_nodes,
+		  Record::dst_size);
+		throw NodeRangeError();
+	}
+
+	config.page_size = sysconf(_SC_PAGE_SIZE); // works on POSIX systems (alternative is boost)
+	int file_flags = O_RDWR;
 	if (reset) {
 		file_flags |= O_TRUNC;
 	}
+	if (opts.direct_io) {
+		file_flags |= O_DIRECT; // bypass the page cache
+	}
 
-	if (M < page_size) {
+	if (M < config.page_size) {
 		printf("WARNING: requested buffer size smaller than page_size. Set to page_size.\n");
-		M = page_size;
-	}
-	
-	// setup static variables
-	max_level       = ceil(log(N) / log(B));
-	buffer_size     = M; // probably figure out a better solution than this
-	backing_EOF     = 0;
-	leaf_size       = floor(24 * pow(log2(N), 3)); // size of leaf proportional to size of sketch
-	leaf_size       = (leaf_size < page_size)? page_size : leaf_size; //enforce size of at least page_size
-
-	// malloc the memory for the root node
-	root_node = (char *) malloc(buffer_size);
-	root_position = 0;
-
-	// malloc the memory used when flushing
-	flush_buffers   = (char ***) malloc(sizeof(char **) * max_level);
-	flush_positions = (char ***) malloc(sizeof(char **) * max_level);
-	read_buffers    = (char **)  malloc(sizeof(char *)  * max_level);
-	for (int l = 0; l < max_level; l++) {
-		flush_buffers[l]   = (char **) malloc(sizeof(char *) * B);
-		flush_positions[l] = (char **) malloc(sizeof(char *) * B);
-		read_buffers[l]    = (char *)  malloc(sizeof(char) * (buffer_size + page_size));
-		for (uint i = 0; i < B; i++) {
-			flush_buffers[l][i] = (char *) calloc(page_size, sizeof(char));
-		}
+		M = config.page_size;
 	}
 
+	config.max_level       = ceil(log(N) / log(B));
+	config.buffer_size     = M; // probably figure out a better solution than this
+	// a buffer waiting in the flush queue keeps accepting writes until it holds 2M
+	config.buffer_capacity = (opts.flush_workers > 0)? 2 * config.buffer_size
+	                                                 : config.buffer_size + config.page_size;
+	config.backing_EOF     = 0;
+	Node sketch_nodes      = (opts.graph_nodes > 0)? opts.graph_nodes : N;
+	config.leaf_size       = floor(24 * pow(log2(sketch_nodes), 3)); // size of leaf proportional to size of sketch
+	config.leaf_size       = std::max<uint64_t>(config.leaf_size, config.page_size); //enforce size of at least page_size
+	config.compact         = opts.compact;
+
+	// root shards are created as threads first insert
+	tree_id = next_tree_id++;
+
+	// the memory used when flushing is allocated as flushes need it
+
 	// open the file which will be our backing store for the non-root nodes
 	// create it if it does not already exist
-	std::string file_name = dir + "buffer_tree_v0.2.data";
-	printf("opening file %s\n", file_name.c_str());
-	backing_store = open(file_name.c_str(), file_flags, S_IRUSR | S_IWUSR);
-	if (backing_store == -1) {
-		fprintf(stderr, "Failed to open backing storage file! error=%s\n", strerror(errno));
-		exit(1);
+	storage_t storage = opts.storage;
+	if (storage == URING_STORAGE && !UringBackend::available()) {
+		printf("WARNING: io_uring is not available. Using pread/pwrite instead.\n");
+		storage = FILE_STORAGE;
+	}
+	if (this->dirs.size() > 1 && (storage == MEMORY_STORAGE || storage == MMAP_STORAGE)) {
+		printf("WARNING: only file storage may be striped. Using the first directory.\n");
+		this->dirs.resize(1);
+	}
+	// with several directories each holds a file of its own, see StripedBackend
+	std::vector<StorageBackend*> devices;
+	for (std::string &dir : this->dirs) {
+		std::string file_name = dir + "buffer_tree_v0.2.data";
+		if (storage == URING_STORAGE)
+			devices.push_back(new UringBackend(file_name, file_flags));
+		else if (storage == MEMORY_STORAGE)
+			devices.push_back(new MemoryBackend());
+		else if (storage == MMAP_STORAGE)
+			devices.push_back(new MmapBackend(file_name, file_flags));
+		else
+			devices.push_back(new FileBackend(file_name, file_flags));
+	}
+	striped = nullptr;
+	if (devices.size() > 1)
+		config.backing_store = striped = new StripedBackend(devices);
+	else
+		config.backing_store = devices[0];
+
+	// create the circular queues in which we will place ripe fruit (full leaves)
+	// make space for full 2 * workers full updates, split between the queues
+	// slots are a whole number of pages so that leaves may be read into them
+	uint32_t slot_size = config.leaf_size + config.page_size;
+	slot_size += (config.page_size - slot_size % config.page_size) % config.page_size;
+	int num_queues = (opts.consumer_queues > 0)? opts.consumer_queues : 1;
+	int queue_len  = std::max(2, (2*workers + num_queues - 1) / num_queues);
+	if (opts.queue_bytes > 0)
+		queue_len = std::max<uint64_t>(1, opts.queue_bytes / slot_size);
+	int max_len = std::max<uint64_t>(queue_len, opts.max_queue_bytes / slot_size);
+	// queue buffers are allocated by whichever thread first needs them, so
+	// they are placed on the tree's NUMA node explicitly, as are root shards
+	numa_node = opts.numa_node;
+	for (int q = 0; q < num_queues; q++) {
+		queues.push_back(new CircularQueue(queue_len, slot_size, max_len));
+		queues.back()->set_numa_node(numa_node);
+	}
+	non_block = false;
+	parked_bytes = 0;
+	bytes_written = 0;
+	combine_mode = opts.combine;
+	sort_leaves  = opts.sort_leaves;
+	reducer      = opts.reducer;
+
+	// buffers in which the updates of hot keys skip the rest of the tree
+	hot_keys = nullptr;
+	if (opts.hot_keys > 0) {
+		hot_keys = new HotKeys(opts.hot_keys, std::max<uint64_t>(1024, 64 * opts.hot_keys));
+		for (uint32_t i = 0; i < opts.hot_keys; i++) {
+			hot_buffers.push_back(alloc_pages(config.leaf_size + config.page_size, config.page_size));
+			hot_sizes.push_back(0);
+		}
 	}
 
+	// an in memory or mapped backing store hands leaves to the queues in place.
+	// Leaves then need spare extents to move to, one more than the queues hold
+	bool in_place = storage == MEMORY_STORAGE || storage == MMAP_STORAGE;
+	num_spare_extents = in_place? num_queues * max_len + 1 : 0;
+
 	setup_tree(); // setup the buffer tree
 
-	// create the circular queue in which we will place ripe fruit (full leaves)
-	// make space for full 2 * workers full updates
-	cq = new CircularQueue(2*workers, leaf_size + page_size);
-	
-	// will want to use mmap instead? - how much is in RAM after allocation (none?)
-	// can't use mmap instead might use it as well. (Still need to create the file to be a given size)
-	// will want to use pwrite/read so that the IOs are thread safe and all threads can share a single file descriptor
-	// if we don't use mmap that is
+	// workers pinned to a NUMA node also allocate their flush scratch there
+	flush_task_t on_start = nullptr;
+	int node = numa_node;
+	if (node >= 0) on_start = [node]() {bind_to_numa_node(node);};
+	scheduler = (opts.flush_workers > 0)? new FlushScheduler(opts.flush_workers, on_start) : nullptr;
+	flush_kernel = SCATTER_KERNEL;
 
 	// printf("Successfully created buffer tree\n");
 }
 
-BufferTree::~BufferTree() {
+template <class Record>
+BasicBufferTree<Record>::~BasicBufferTree() {
 	printf("Closing BufferTree\n");
 	// force_flush(); // flush everything to leaves (could just flush to files in higher levels)
+	delete scheduler; // finish any outstanding flushes
 
 	// free malloc'd memory
-	for(int l = 0; l < max_level; l++) {
-		free(flush_positions[l]);
-		free(read_buffers[l]);
-		for (uint16_t i = 0; i < B; i++) {
-			free(flush_buffers[l][i]);
+	for (FlushScratch *scratch : free_scratch) {
+		free(scratch->read_buffer);
+		for (uint i = 0; i < B; i++) {
+			free(scratch->flush_buffers[i]);
 		}
-		free(flush_buffers[l]);
+		free(scratch->flush_buffers);
+		free(scratch->flush_positions);
+		free(scratch->partition_buffer);
+		free(scratch->routes);
+		free(scratch->offsets);
+		free(scratch->positions);
+		free(scratch->encode_buffer);
+		delete scratch;
 	}
-	free(flush_buffers);
-	free(flush_positions);
-	free(read_buffers);
 
-	free(root_node);
+	for (auto &entry : shards) {
+		RootShard *shard = entry.second;
+		free(shard->buffer);
+		free(shard->spare);
+		free(shard->hot_staged);
+		delete shard;
+	}
 	for(uint i = 0; i < buffers.size(); i++) {
 		if (buffers[i] != nullptr)
 			delete buffers[i];
 	}
-	delete cq;
-	close(backing_store);
+	for (ParkedLeaf &leaf : parked)
+		free(leaf.data);
+	for (char *buf : hot_buffers)
+		free(buf);
+	for (char *buf : free_hot)
+		free(buf);
+	delete hot_keys;
+	for (CircularQueue *cq : queues)
+		delete cq;
+	delete config.backing_store;
 }
 
 void print_tree(std::vector<BufferControlBlock *>bcb_list) {
@@ -118,16 +236,18 @@ void print_tree(std::vector<BufferControlBlock *>bcb_list) {
 }
 
 // TODO: clean up this function
-void BufferTree::setup_tree() {
-	printf("Creating a tree of depth %i\n", max_level);
+template <class Record>
+void BasicBufferTree<Record>::setup_tree() {
+	printf("Creating a tree of depth %i\n", config.max_level);
 	File_Pointer size = 0;
+	std::vector<uint32_t> device; // the directory each buffer is stored in
 
 	// create the BufferControlBlocks
-	for (uint l = 1; l <= max_level; l++) { // loop through all levels
+	for (uint l = 1; l <= config.max_level; l++) { // loop through all levels
 		uint level_size    = pow(B, l); // number of blocks in this level
 		uint plevel_size   = pow(B, l-1);
 		uint start         = buffers.size();
-		Node key           = 0;
+		Node key           = first_key;
 		double parent_keys = N;
 		uint options       = B;
 		bool skip          = false;
@@ -148,7 +268,7 @@ void BufferTree::setup_tree() {
 				continue;
 			}
 
-			BufferControlBlock *bcb = new BufferControlBlock(start + index, size, l);
+			BufferControlBlock *bcb = new BufferControlBlock(start + index, 0, l, &config);
 	 		bcb->min_key     = key;
 	 		key              += ceil(parent_keys/options);
 			bcb->max_key     = key - 1;
@@ -159,87 +279,281 @@ void BufferTree::setup_tree() {
 			parent_keys -= ceil(parent_keys/options);
 			options--;
 			buffers.push_back(bcb);
+			// level 1 buffers take turns at the directories, the rest follow their parent
+			device.push_back((l == 1)? index % dirs.size() : device[parent]);
 			index++; // seperate variable because sometimes we skip stuff
-			if(bcb->is_leaf())
-				size += leaf_size + page_size;
-			else 
-				size += buffer_size + page_size;
 		}
 	}
 
+	// lay the buffers out one directory after another and, within a
+	// directory, level by level. So a subtree is stored in a single file
+	std::vector<File_Pointer> device_start;
+	std::vector<File_Pointer> level_start; // where each level of each directory begins
+	for (uint32_t d = 0; d < dirs.size(); d++) {
+		device_start.push_back(size);
+		uint l = 0;
+		for (BufferControlBlock *bcb : buffers) {
+			if (device[bcb->get_id()] != d) continue;
+			for (; l < bcb->level; l++) level_start.push_back(size);
+			bcb->relocate(size);
+			// every buffer starts on a page boundary so that O_DIRECT IO to one
+			// buffer never touches the pages of another
+			File_Pointer bcb_size = bcb->is_leaf()? config.leaf_size + config.page_size
+			                                      : config.buffer_capacity;
+			bcb_size += config.compact? config.page_size : 0; // for encodings which don't shrink the data
+			size += bcb_size + (config.page_size - bcb_size % config.page_size) % config.page_size;
+		}
+		for (; l < config.max_level; l++) level_start.push_back(size);
+	}
+
+	// spare room for leaves handed to the circular queue in place
+	File_Pointer extent_size = config.leaf_size + config.page_size;
+	extent_size += (config.page_size - extent_size % config.page_size) % config.page_size;
+	for (uint i = 0; i < num_spare_extents; i++) {
+		spare_extents.push_back(size);
+		size += extent_size;
+	}
+
     // allocate file space for all the nodes to prevent fragmentation
-    #ifdef HAVE_FALLOCATE
-	fallocate(backing_store, 0, 0, size); // linux only but fast
-	#else
-	posix_fallocate(backing_store, 0, size); // portable but much slower
-    #endif
-    
-    backing_EOF = size;
+	if (striped != nullptr)
+		striped->set_regions(device_start);
+	config.backing_store->allocate(size);
+
+	// the first level is small and written to by every root flush. Lower
+	// levels are streamed through a buffer at a time, except for the leaves
+	// which are spread over the whole last level (and the spare extents)
+	level_start.push_back(size);
+	for (size_t r = 0; r + 1 < level_start.size(); r++) {
+		uint l = r % config.max_level + 1;
+		access_hint_t hint = ACCESS_SEQUENTIAL;
+		if (l == config.max_level)
+			hint = ACCESS_RANDOM;
+		else if (l == 1)
+			hint = ACCESS_HOT;
+		if (level_start[r+1] > level_start[r])
+			config.backing_store->advise(level_start[r], level_start[r+1] - level_start[r], hint);
+	}
+
+    config.backing_EOF = size;
+
+	// precompute how each node routes keys to its children
+	root_router.init(first_key, first_key + N-1, B);
+	for (BufferControlBlock *bcb : buffers) {
+		if (!bcb->is_leaf())
+			bcb->router.init(bcb->min_key, bcb->max_key, bcb->children_num);
+	}
     // print_tree(buffers);
 }
 
 // serialize an update to a data location (should only be used for root I think)
-inline void BufferTree::serialize_update(char *dst, update_t src) {
-	Node node1 = src.first;
-	Node node2 = src.second;
-
-	memcpy(dst, &node1, sizeof(Node));
-	memcpy(dst + sizeof(Node), &node2, sizeof(Node));
+template <class Record>
+inline void BasicBufferTree<Record>::serialize_update(char *dst, record_t src) {
+	Record::serialize(dst, src);
 }
 
-inline update_t BufferTree::deserialize_update(char *src) {
-	update_t dst;
-	memcpy(&dst.first, src, sizeof(Node));
-	memcpy(&dst.second, src + sizeof(Node), sizeof(Node));
-
-	return dst;
+template <class Record>
+inline typename BasicBufferTree<Record>::record_t BasicBufferTree<Record>::deserialize_update(const char *src) {
+	return Record::deserialize(src);
 }
 
-// copy two serailized updates between two locations
-inline void BufferTree::copy_serial(char *src, char *dst) {
+// copy two serailized updates between two locations. serial_update_size is a
+// compile time constant so this is a fixed size copy for every record
+template <class Record>
+inline void BasicBufferTree<Record>::copy_serial(const char *src, char *dst) {
 	memcpy(dst, src, serial_update_size);
 }
 
 /*
  * Load a key from a given location
  */
-inline Node BufferTree::load_key(char *location) {
-	Node key;
-	memcpy(&key, location, sizeof(Node));
-	return key;
+template <class Record>
+inline Node BasicBufferTree<Record>::load_key(const char *location) {
+	return Record::load_key(location);
+}
+
+template <class Record>
+typename BasicBufferTree<Record>::RootShard *BasicBufferTree<Record>::new_shard() {
+	RootShard *shard       = new RootShard();
+	shard->buffer          = alloc_pages(M, config.page_size);
+	shard->position        = 0;
+	shard->spare           = alloc_pages(M, config.page_size);
+	shard->in_flight       = false;
+	shard->hot_generation  = 0;
+	shard->hot_skip        = 1;
+	shard->hot_rng         = 0x9E3779B97F4A7C15ull ^ (uint64_t) shard;
+	shard->hot_staged      = (hot_keys != nullptr)? alloc_pages(M, config.page_size) : nullptr;
+
+	// a shard is made on its producer's first insert, and producers are not
+	// bound to the tree's NUMA node as its flush workers are
+	if (numa_node >= 0) {
+		place_on_numa_node(shard->buffer, M, numa_node);
+		place_on_numa_node(shard->spare, M, numa_node);
+		if (shard->hot_staged != nullptr) place_on_numa_node(shard->hot_staged, M, numa_node);
+	}
+	return shard;
+}
+
+template <class Record>
+typename BasicBufferTree<Record>::FlushScratch *BasicBufferTree<Record>::checkout_scratch() {
+	{
+		std::lock_guard<std::mutex> lk(scratch_lock);
+		if (!free_scratch.empty()) {
+			FlushScratch *scratch = free_scratch.back();
+			free_scratch.pop_back();
+			return scratch;
+		}
+	}
+
+	// every scratch is in use so make another one
+	FlushScratch *scratch    = new FlushScratch();
+	scratch->read_buffer     = alloc_pages(config.buffer_capacity, config.page_size); // leaves are read into the queue
+	scratch->flush_buffers   = (char **) malloc(sizeof(char *) * B);
+	scratch->flush_positions = (char **) malloc(sizeof(char *) * B);
+	for (uint i = 0; i < B; i++) {
+		scratch->flush_buffers[i] = alloc_pages(config.page_size, config.page_size);
+		memset(scratch->flush_buffers[i], 0, config.page_size);
+	}
+	scratch->partition_buffer = nullptr;
+	scratch->routes           = nullptr;
+	scratch->offsets          = nullptr;
+	scratch->positions        = nullptr;
+	scratch->bytes_written    = 0;
+
+	// room for a batch of encoded writes or a buffer read back, whichever is larger
+	scratch->encode_buffer = nullptr;
+	if (config.compact) {
+		uint64_t most = std::max<uint64_t>(std::max<uint64_t>(config.buffer_capacity,
+		  config.leaf_size + config.page_size), (uint64_t) B * config.page_size);
+		scratch->encode_buffer = alloc_pages(most + config.page_size + B * max_block_header, config.page_size);
+	}
+	return scratch;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::return_scratch(FlushScratch *scratch) {
+	std::lock_guard<std::mutex> lk(scratch_lock);
+	bytes_written += scratch->bytes_written;
+	scratch->bytes_written = 0;
+	free_scratch.push_back(scratch);
+}
+
+/*
+ * Find the root shard belonging to the calling thread, creating it upon
+ * the thread's first insert. Shards are cached thread locally by tree, so
+ * the common case never touches shard_lock even when a thread inserts to
+ * many trees in turn, as a ShardedBufferTree's producers do. Tree ids are
+ * handed out in order, so consecutive trees never share a cache entry.
+ */
+template <class Record>
+inline typename BasicBufferTree<Record>::RootShard *BasicBufferTree<Record>::get_shard() {
+	struct CachedShard {
+		uint64_t tree;
+		RootShard *shard;
+	};
+	static thread_local CachedShard cache[shard_cache_size];
+	CachedShard &cached = cache[tree_id % shard_cache_size];
+	if (cached.tree == tree_id)
+		return cached.shard;
+
+	std::lock_guard<std::mutex> lk(shard_lock);
+	RootShard *&shard = shards[std::this_thread::get_id()];
+	if (shard == nullptr)
+		shard = new_shard();
+
+	cached.tree  = tree_id;
+	cached.shard = shard;
+	return shard;
 }
 
 /*
  * Perform an insertion to the buffer-tree
- * Insertions always go to the root
+ * Insertions always go to the calling thread's shard of the root
  */
-insert_ret_t BufferTree::insert(update_t upd) {
+template <class Record>
+insert_ret_t BasicBufferTree<Record>::insert(record_t upd) {
 	// printf("inserting to buffer tree . . . ");
-	// root_lock.lock();
-	if (root_position + serial_update_size > M) {
-		flush_root();
+	RootShard *shard = get_shard();
+	if (shard->position + serial_update_size > M) {
+		flush_root(shard);
 	}
 
-	serialize_update(root_node + root_position, upd);
-	root_position += serial_update_size;
-	// root_lock.unlock();
+	serialize_update(shard->buffer + shard->position, upd);
+	shard->position += serial_update_size;
 	// printf("done insert\n");
 }
 
-/*
- * Helper function which determines which child we should flush to
- */
-inline uint32_t which_child(Node key, Node min_key, Node max_key, uint16_t options) {
-	Node total = max_key - min_key + 1;
-	double div = (double)total / options;
-	uint larger_kids = total % options;
-	uint larger_count = larger_kids * ceil(div);
-	Node idx = key - min_key;
-
-	if (idx >= larger_count)
-		return ((idx - larger_count) / (int)div) + larger_kids;
-	else
-		return idx / ceil(div);
+// a packed record_t, like update_t, is laid out exactly as serialize_update
+// writes it, so a span of updates is already serialized
+static_assert(NodeRecord::packed, "update_t must match its serialization");
+
+template <class Record>
+insert_ret_t BasicBufferTree<Record>::insert_batch(const record_t *upds, size_t n) {
+	if (Record::packed) {
+		insert_serialized(reinterpret_cast<const char *>(upds), n * serial_update_size);
+		return;
+	}
+	for (size_t i = 0; i < n; i++)
+		insert(upds[i]);
+}
+
+template <class Record>
+insert_ret_t BasicBufferTree<Record>::insert_serialized(const char *data, size_t size) {
+	insert_data(data, size, true);
+}
+
+template <class Record>
+bool BasicBufferTree<Record>::try_insert(record_t upd) {
+	RootShard *shard = get_shard();
+	if (shard->position + serial_update_size > M && !make_room(shard, false))
+		return false;
+
+	serialize_update(shard->buffer + shard->position, upd);
+	shard->position += serial_update_size;
+	return true;
+}
+
+template <class Record>
+size_t BasicBufferTree<Record>::try_insert_batch(const record_t *upds, size_t n) {
+	if (!Record::packed) {
+		size_t i = 0;
+		while (i < n && try_insert(upds[i])) i++;
+		return i;
+	}
+	return insert_data(reinterpret_cast<const char *>(upds), n * serial_update_size, false)
+	  / serial_update_size;
+}
+
+template <class Record>
+size_t BasicBufferTree<Record>::insert_data(const char *data, size_t size, bool may_block) {
+	RootShard *shard = get_shard();
+	const uint32_t root_cap = M - (M % serial_update_size);
+	const uint32_t max_span = (1 << 30) - ((1 << 30) % serial_update_size); // keep do_flush sizes in range
+	size_t accepted = 0;
+
+	// spans at least as large as the root skip it and are partitioned
+	// straight into level 1. Such a flush may wait on consumers so
+	// non-blocking inserts always go through the root
+	while (may_block && size >= root_cap) {
+		uint32_t span = (size < max_span)? size : max_span;
+		flush_root_data(data, span);
+		data += span;
+		size -= span;
+		accepted += span;
+	}
+
+	// the remainder is bulk copied into the root
+	while (size > 0) {
+		if (shard->position == root_cap && !make_room(shard, may_block))
+			break;
+		uint32_t len = root_cap - shard->position;
+		len = (size < len)? size : len;
+		memcpy(shard->buffer + shard->position, data, len);
+		shard->position += len;
+		data += len;
+		size -= len;
+		accepted += len;
+	}
+	return accepted;
 }
 
 /*
@@ -249,27 +563,34 @@ inline uint32_t which_child(Node key, Node min_key, Node max_key, uint16_t optio
  * IMPORTANT: after perfoming the flush it is the caller's responsibility to reset
  * the number of elements in the buffer and associated pointers.
  *
- * IMPORTANT: Unless we add more flush_buffers only a single flush at each level may occur 
- * at once otherwise the data will clash
+ * The scratch space is the caller's for the duration of the flush, so flushes
+ * may run concurrently anywhere in the tree.
  */
-flush_ret_t BufferTree::do_flush(char *data, uint32_t data_size, uint32_t begin, 
-	Node min_key, Node max_key, uint16_t options, uint8_t level) {
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::do_flush(const char *data, uint32_t data_size, uint32_t begin, 
+	const ChildRouter &router, FlushScratch *scratch) {
+	if (flush_kernel == RADIX_KERNEL) {
+		do_radix_flush(data, data_size, begin, router, scratch);
+		return;
+	}
+
 	// setup
-	uint32_t full_flush = page_size - (page_size % serial_update_size);
+	uint32_t full_flush = config.page_size - (config.page_size % serial_update_size);
 
-	char **flush_pos = flush_positions[level];
-	char **flush_buf = flush_buffers[level];
+	char **flush_pos = scratch->flush_positions;
+	char **flush_buf = scratch->flush_buffers;
 
-	char *data_start = data;
-	for (uint i = 0; i < B; i++) {
+	const char *data_start = data;
+	for (uint i = 0; i < router.options; i++) {
 		flush_pos[i] = flush_buf[i];
 	}
 
 	while (data - data_start < data_size) {
 		Node key = load_key(data);
-		uint32_t child  = which_child(key, min_key, max_key, options);
-		if (child > B - 1) {
-			printf("ERROR: incorrect child %u abandoning insert key=%lu min=%lu max=%lu\n", child, key, min_key, max_key);
+		uint32_t child  = router.route(key);
+#ifdef VERIFY_ROUTING
+		if (child >= router.options) {
+			printf("ERROR: incorrect child %u abandoning insert key=%lu min=%lu\n", child, key, router.min_key);
 			printf("first child = %u\n", buffers[begin]->get_id());
 			printf("data pointer = %lu data_start=%lu data_size=%u\n", (uint64_t) data, (uint64_t) data_start, data_size);
 			throw KeyIncorrectError();
@@ -279,6 +600,7 @@ flush_ret_t BufferTree::do_flush(char *data, uint32_t data_size, uint32_t begin,
 				key, child, buffers[child+begin]->min_key, buffers[child+begin]->max_key);
 			throw KeyIncorrectError();
 		}
+#endif
  
 		copy_serial(data, flush_pos[child]);
 		flush_pos[child] += serial_update_size;
@@ -286,9 +608,7 @@ flush_ret_t BufferTree::do_flush(char *data, uint32_t data_size, uint32_t begin,
 		if (flush_pos[child] - flush_buf[child] >= full_flush) {
 			// write to our child, return value indicates if it needs to be flushed
 			uint size = flush_pos[child] - flush_buf[child];
-			if(buffers[begin+child]->write(flush_buf[child], size)) {
-				flush_control_block(buffers[begin+child]);
-			}
+			write_child(buffers[begin+child], flush_buf[child], size, scratch);
 
 			flush_pos[child] = flush_buf[child]; // reset the flush_position
 		}
@@ -296,134 +616,894 @@ flush_ret_t BufferTree::do_flush(char *data, uint32_t data_size, uint32_t begin,
 	}
 
 	// loop through the flush buffers and write out any non-empty ones
-	for (uint i = 0; i < B; i++) {
+	bool batch = config.backing_store->batches_writes();
+	for (uint i = 0; i < router.options; i++) {
 		if (flush_pos[i] - flush_buf[i] > 0) {
 			// write to child i, return value indicates if it needs to be flushed
 			uint size = flush_pos[i] - flush_buf[i];
-			if(buffers[begin+i]->write(flush_buf[i], size)) {
-				flush_control_block(buffers[begin+i]);
+			if (batch) {
+				scratch->batch_children.push_back(buffers[begin+i]);
+				scratch->batch_reqs.push_back({flush_buf[i], size, 0});
 			}
+			else
+				write_child(buffers[begin+i], flush_buf[i], size, scratch);
 		}
 	}
+	if (batch)
+		write_children(scratch);
 }
 
-flush_ret_t inline BufferTree::flush_root() {
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::do_radix_flush(const char *data, uint32_t data_size, uint32_t begin, 
+	const ChildRouter &router, FlushScratch *scratch) {
+	// the largest number of bytes we partition at once. Spans inserted
+	// directly from insert_serialized may be larger than this
+	const uint32_t span = config.buffer_capacity - (config.buffer_capacity % serial_update_size);
+	if (scratch->partition_buffer == nullptr) {
+		scratch->partition_buffer = alloc_pages(span, config.page_size);
+		scratch->routes    = (uint16_t *) alloc_pages(sizeof(uint16_t) * (span / serial_update_size),
+		  config.page_size);
+		scratch->offsets   = (uint32_t *) alloc_pages(sizeof(uint32_t) * (B + 1), config.page_size);
+		scratch->positions = (uint32_t *) alloc_pages(sizeof(uint32_t) * B, config.page_size);
+	}
+	char *out         = scratch->partition_buffer;
+	uint16_t *routes  = scratch->routes;
+	uint32_t *offsets = scratch->offsets;
+	uint32_t *pos     = scratch->positions;
+
+	while (data_size > 0) {
+		uint32_t size = (data_size < span)? data_size : span;
+		uint32_t num  = size / serial_update_size;
+
+		// pass 1: route every update and count the updates per child.
+		// Unrolled so the key loads and multiplies of neighbouring
+		// updates are independent of one another
+		std::fill(offsets, offsets + router.options + 1, 0);
+		uint32_t i = 0;
+		for (; i + 4 <= num; i += 4) {
+			const char *rec = data + i * serial_update_size;
+			uint16_t r0 = router.route(load_key(rec));
+			uint16_t r1 = router.route(load_key(rec + serial_update_size));
+			uint16_t r2 = router.route(load_key(rec + 2 * serial_update_size));
+			uint16_t r3 = router.route(load_key(rec + 3 * serial_update_size));
+			routes[i] = r0; routes[i+1] = r1; routes[i+2] = r2; routes[i+3] = r3;
+			offsets[r0+1]++; offsets[r1+1]++; offsets[r2+1]++; offsets[r3+1]++;
+		}
+		for (; i < num; i++) {
+			routes[i] = router.route(load_key(data + i * serial_update_size));
+			offsets[routes[i]+1]++;
+		}
+#ifdef VERIFY_ROUTING
+		for (i = 0; i < num; i++) {
+			Node key = load_key(data + i * serial_update_size);
+			if (routes[i] >= router.options || buffers[begin+routes[i]]->min_key > key 
+			  || buffers[begin+routes[i]]->max_key < key) {
+				printf("ERROR: bad key %lu for child %u\n", key, routes[i]);
+				throw KeyIncorrectError();
+			}
+		}
+#endif
+
+		// offsets[c] is now where child c's region begins
+		for (uint c = 0; c < router.options; c++) {
+			offsets[c+1] += offsets[c];
+		}
+
+		// pass 2: scatter the updates into their child's region
+		std::copy(offsets, offsets + router.options, pos);
+		for (i = 0; i < num; i++) {
+			copy_serial(data + i * serial_update_size, out + pos[routes[i]] * serial_update_size);
+			pos[routes[i]]++;
+		}
+
+		// write each region to its child, no larger than the child's flush
+		// threshold at a time so that the write always fits once flushed.
+		// If the backend batches writes then the first chunk of every region
+		// goes out in a single submission and only the remainder is written
+		// one chunk at a time
+		bool batch = config.backing_store->batches_writes();
+		for (uint c = 0; c < router.options; c++) {
+			BufferControlBlock *bcb = buffers[begin+c];
+			uint32_t max_write = bcb->is_leaf()? config.leaf_size : config.buffer_size;
+			max_write -= max_write % serial_update_size;
+			uint32_t remain = (offsets[c+1] - offsets[c]) * serial_update_size;
+			if (batch && remain > 0) {
+				uint32_t len = (remain < max_write)? remain : max_write;
+				scratch->batch_children.push_back(bcb);
+				scratch->batch_reqs.push_back({out + offsets[c] * serial_update_size, len, 0});
+			}
+		}
+		if (batch)
+			write_children(scratch);
+
+		for (uint c = 0; c < router.options; c++) {
+			BufferControlBlock *bcb = buffers[begin+c];
+			uint32_t max_write = bcb->is_leaf()? config.leaf_size : config.buffer_size;
+			max_write -= max_write % serial_update_size;
+			char *region     = out + offsets[c] * serial_update_size;
+			uint32_t remain  = (offsets[c+1] - offsets[c]) * serial_update_size;
+			if (batch) {
+				uint32_t len = (remain < max_write)? remain : max_write;
+				region += len;
+				remain -= len;
+			}
+			while (remain > 0) {
+				uint32_t len = (remain < max_write)? remain : max_write;
+				write_child(bcb, region, len, scratch);
+				region += len;
+				remain -= len;
+			}
+		}
+		data      += size;
+		data_size -= size;
+	}
+}
+
+/*
+ * Write data to a child of a buffer being flushed. If other writers have
+ * filled the child in the meantime then flush it first to make room.
+ */
+template <class Record>
+inline void BasicBufferTree<Record>::write_child(BufferControlBlock *bcb, char *data, uint32_t size,
+  FlushScratch *scratch) {
+	if (!config.compact) {
+		scratch->bytes_written += size;
+		write_encoded(bcb, data, size, size);
+		return;
+	}
+	uint32_t enc_size = encode_records<Record>(data, size / serial_update_size, bcb->is_leaf(),
+	  scratch->encode_buffer);
+	scratch->bytes_written += enc_size;
+	write_encoded(bcb, scratch->encode_buffer, enc_size, size);
+}
+
+template <class Record>
+inline void BasicBufferTree<Record>::write_encoded(BufferControlBlock *bcb, const char *data, uint32_t size,
+  uint32_t raw_size) {
+	write_ret_t ret;
+	while ((ret = bcb->write(data, size, raw_size)) == WRITE_FULL)
+		flush_control_block(bcb);
+
+	if (ret == WRITE_NEEDS_FLUSH)
+		schedule_flush(bcb);
+}
+
+/*
+ * Write a batch of child regions gathered in the scratch space with a single
+ * call to the backing store. Space is reserved in every child that has room
+ * while holding its lock, then all writes are submitted together. Children
+ * without room fall back to write_child which flushes them first.
+ */
+template <class Record>
+void BasicBufferTree<Record>::write_children(FlushScratch *scratch) {
+	std::vector<BufferControlBlock*> &children = scratch->batch_children;
+	std::vector<write_req_t> &reqs = scratch->batch_reqs;
+	std::vector<write_req_t> batched;
+	std::vector<BufferControlBlock*> locked;
+	std::vector<size_t> deferred;
+	std::vector<uint32_t> raw_sizes;
+	batched.reserve(reqs.size());
+	locked.reserve(reqs.size());
+
+	// encode every write one after another in the encode buffer. The
+	// regions are the flush's own scratch space, so they may be sorted
+	raw_sizes.reserve(reqs.size());
+	char *enc = scratch->encode_buffer;
+	for (size_t i = 0; i < reqs.size(); i++) {
+		raw_sizes.push_back(reqs[i].size);
+		if (!config.compact) continue;
+		char *upds = const_cast<char *>(reqs[i].data);
+		reqs[i].size = encode_records<Record>(upds, reqs[i].size / serial_update_size,
+		  children[i]->is_leaf(), enc);
+		reqs[i].data = enc;
+		enc += reqs[i].size;
+	}
+
+	for (size_t i = 0; i < reqs.size(); i++) {
+		BufferControlBlock *bcb = children[i];
+		scratch->bytes_written += reqs[i].size;
+		bcb->lock();
+		if (bcb->reserve(reqs[i].size, reqs[i].offset, raw_sizes[i])) {
+			batched.push_back(reqs[i]);
+			locked.push_back(bcb);
+		} else {
+			bcb->unlock();
+			deferred.push_back(i);
+		}
+	}
+
+	if (batched.size() > 0)
+		config.backing_store->write_batch(batched.data(), batched.size());
+
+	for (BufferControlBlock *bcb : locked) {
+		bool need_flush = bcb->needs_flush();
+		bcb->unlock();
+		if (need_flush) schedule_flush(bcb);
+	}
+	for (size_t i : deferred)
+		write_encoded(children[i], reqs[i].data, reqs[i].size, raw_sizes[i]);
+
+	children.clear();
+	reqs.clear();
+}
+
+template <class Record>
+void BasicBufferTree<Record>::schedule_flush(BufferControlBlock *bcb) {
+	if (scheduler == nullptr) {
+		flush_control_block(bcb);
+		return;
+	}
+	if (bcb->flush_queued.exchange(true))
+		return; // already waiting in the flush queue
+
+	scheduler->submit([this, bcb]() {
+		bcb->flush_queued = false;
+		flush_control_block(bcb);
+		wait_parked();
+	});
+}
+
+template <class Record>
+void BasicBufferTree<Record>::wait_root_flushed(RootShard *shard) {
+	std::unique_lock<std::mutex> lk(shard->lock);
+	shard->flushed.wait(lk, [shard]{return !shard->in_flight;});
+}
+
+/*
+ * Flush the shard's current root buffer. With flush workers the full buffer
+ * is swapped for the spare and flushed in the background, so we only wait
+ * if the previous flush of this shard has not finished yet.
+ */
+template <class Record>
+flush_ret_t inline BasicBufferTree<Record>::flush_root(RootShard *shard) {
 	// printf("Flushing root\n");
-	// root_lock.lock(); // TODO - we can probably reduce this locking to only the last page
-	do_flush(root_node, root_position, 0, 0, N-1, B, 0);
-	root_position = 0;
-	// root_lock.unlock();
+	if (scheduler == nullptr) {
+		flush_shard_data(shard, shard->buffer, shard->position);
+		shard->position = 0;
+		return;
+	}
+
+	wait_root_flushed(shard);
+	uint32_t size = shard->position;
+	std::swap(shard->buffer, shard->spare);
+	shard->position  = 0;
+	shard->in_flight = true;
+
+	scheduler->submit([this, shard, size]() {
+		flush_shard_data(shard, shard->spare, size);
+		std::lock_guard<std::mutex> lk(shard->lock);
+		shard->in_flight = false;
+		shard->flushed.notify_all();
+	});
 }
 
-flush_ret_t inline BufferTree::flush_control_block(BufferControlBlock *bcb) {
-	// printf("flushing "); bcb->print();
-	if(bcb->size() == 0) {
-		return; // don't flush empty control blocks
+template <class Record>
+bool BasicBufferTree<Record>::make_room(RootShard *shard, bool may_block) {
+	if (may_block) {
+		flush_root(shard);
+		return true;
+	}
+	if (parked_bytes > 0) drain_parked(false);
+
+	if (scheduler != nullptr) {
+		// the flush workers wait on consumers for us. If they have not
+		// finished with this shard's last flush then the tree is backed up
+		{
+			std::lock_guard<std::mutex> lk(shard->lock);
+			if (shard->in_flight) return false;
+		}
+		flush_root(shard);
+		return true;
+	}
+
+	// leaves we could not queue are still parked
+	if (parked_bytes >= M) return false;
+	park_leaves = true;
+	flush_root(shard);
+	park_leaves = false;
+	return true;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::park_leaf(Node key, char *data, uint32_t size) {
+	std::lock_guard<std::mutex> lk(park_lock);
+	parked.push_back({key, data, size});
+	parked_bytes += size;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::drain_parked(bool may_block) {
+	// take the parked leaves and queue them without holding park_lock, so
+	// that parking a leaf never waits on a drain which waits on consumers
+	std::vector<ParkedLeaf> leaves;
+	{
+		std::unique_lock<std::mutex> lk(park_lock, std::defer_lock);
+		if (may_block)
+			lk.lock();
+		else if (!lk.try_lock())
+			return; // somebody else is draining
+		leaves.swap(parked);
+	}
+
+	size_t kept = 0;
+	for (ParkedLeaf &leaf : leaves) {
+		CircularQueue *cq = queue_for(leaf.key);
+		if (may_block)
+			cq->push(leaf.data, leaf.size);
+		else if (!cq->try_push(leaf.data, leaf.size)) {
+			leaves[kept++] = leaf;
+			continue;
+		}
+		parked_bytes -= leaf.size;
+		free(leaf.data);
+	}
+	if (kept > 0) {
+		std::lock_guard<std::mutex> lk(park_lock);
+		parked.insert(parked.end(), leaves.begin(), leaves.begin() + kept);
+	}
+}
+
+template <class Record>
+void BasicBufferTree<Record>::wait_parked() {
+	if (!park_leaves && parked_bytes >= M)
+		drain_parked(true);
+}
+
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::flush_shard_data(RootShard *shard, char *data, uint32_t size) {
+	if (hot_keys != nullptr)
+		size = divert_hot(shard, data, size);
+	if (combine_mode == COMBINE_BUFFERS)
+		size = combine(data, size, false);
+	flush_root_data(data, size);
+}
+
+template <class Record>
+uint32_t BasicBufferTree<Record>::prepare_leaf(char *data, uint32_t size) {
+	if (combine_mode != COMBINE_NONE)
+		return combine(data, size, true);
+	if (sort_leaves && size > 0)
+		radix_sort_records<Record>(data, size / serial_update_size, false, false);
+	return size;
+}
+
+template <class Record>
+uint32_t BasicBufferTree<Record>::combine(char *data, uint32_t size, bool leaf) {
+	size_t n = size / serial_update_size;
+	if (n == 0) return 0;
+
+	// the updates of a leaf all share a source so sorting by destination will do.
+	// Payloads are sorted too so that only identical updates are adjacent
+	radix_sort_records<Record>(data, n, !leaf, true);
+	if (reducer) {
+		static_assert(Record::packed, "reducers need records laid out as they are serialized");
+		return reducer(reinterpret_cast<record_t *>(data), n) * serial_update_size;
+	}
+
+	// under XOR an even number of copies of an update cancels out
+	size_t kept = 0;
+	for (size_t i = 0; i < n;) {
+		const char *upd = data + i * serial_update_size;
+		size_t j = i + 1;
+		while (j < n && memcmp(data + j * serial_update_size, upd, serial_update_size) == 0) j++;
+		if ((j - i) % 2 == 1)
+			copy_serial(upd, data + kept++ * serial_update_size);
+		i = j;
+	}
+	return kept * serial_update_size;
+}
+
+/*
+ * Move the updates of hot keys out of a root buffer and into their hot
+ * buffers, compacting the remaining updates at the front of the root.
+ * Keys are sampled along the way to choose the hot keys.
+ */
+template <class Record>
+uint32_t BasicBufferTree<Record>::divert_hot(RootShard *shard, char *data, uint32_t size) {
+	// sample keys and pick out hot updates using the shard's own counts and
+	// copy of the hot keys, so that other shards' flushes are not held up.
+	// The gaps between samples vary so that periodic streams are not aliased
+	char *keep = data;
+	char *staged = shard->hot_staged;
+	for (char *pos = data; pos < data + size; pos += serial_update_size) {
+		Node key = load_key(pos);
+		if (--shard->hot_skip == 0) {
+			shard->hot_counts[key]++;
+			uint64_t &x = shard->hot_rng;
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+			shard->hot_skip = 1 + x % (2 * hot_sample_rate - 1);
+		}
+		if (shard->hot_set.find(key) < 0) {
+			if (keep != pos) copy_serial(pos, keep);
+			keep += serial_update_size;
+			continue;
+		}
+		copy_serial(pos, staged);
+		staged += serial_update_size;
+	}
+
+	// the lock is only held to count the samples and append to the hot
+	// buffers. Full hot buffers are swapped out and queued once it is released
+	std::vector<ParkedLeaf> full;
+	{
+		std::lock_guard<std::mutex> lk(hot_lock);
+		bool refresh = false;
+		for (auto &entry : shard->hot_counts)
+			refresh |= hot_keys->sample(entry.first, entry.second);
+		shard->hot_counts.clear();
+		if (refresh) refresh_hot(full);
+
+		for (char *pos = shard->hot_staged; pos < staged; pos += serial_update_size) {
+			Node key = load_key(pos);
+			int32_t slot = hot_keys->find(key);
+			if (slot < 0) { // the key went cold since the shard looked
+				copy_serial(pos, keep);
+				keep += serial_update_size;
+				continue;
+			}
+			copy_serial(pos, hot_buffers[slot] + hot_sizes[slot]);
+			hot_sizes[slot] += serial_update_size;
+			if (hot_sizes[slot] >= config.leaf_size)
+				take_hot(slot, key, full);
+		}
+		if (shard->hot_generation != hot_keys->generation()) {
+			shard->hot_set        = hot_keys->hot_set();
+			shard->hot_generation = hot_keys->generation();
+		}
 	}
+	emit_hot(full);
+	return keep - data;
+}
 
-	// flushing a control block is the only time read_buffers are used
-	// and we call this on the bottom level of the tree (max_level) so
-	// level-1 for the read_buffers is important.
+template <class Record>
+void BasicBufferTree<Record>::refresh_hot(std::vector<ParkedLeaf> &full) {
+	std::vector<std::pair<uint32_t, Node>> evicted;
+	hot_keys->refresh(evicted);
 
-	uint32_t data_to_read = bcb->size();
-	uint8_t level = bcb->level;
-	uint32_t offset = 0;
-	while(data_to_read > 0) {
-		int len = pread(backing_store, read_buffers[level-1] + offset, data_to_read, bcb->offset() + offset);
-		if (len == -1) {
-			printf("ERROR flush failed to read from buffer %i, %s\n", bcb->get_id(), strerror(errno));
-			exit(EXIT_FAILURE);
+	// keys which are no longer hot hand over what they have gathered
+	for (auto &slot : evicted)
+		take_hot(slot.first, slot.second, full);
+}
+
+template <class Record>
+void BasicBufferTree<Record>::take_hot(uint32_t slot, Node key, std::vector<ParkedLeaf> &full) {
+	if (hot_sizes[slot] == 0) return;
+	full.push_back({key, hot_buffers[slot], hot_sizes[slot]});
+	hot_sizes[slot] = 0;
+	if (free_hot.empty()) {
+		hot_buffers[slot] = alloc_pages(config.leaf_size + config.page_size, config.page_size);
+	} else {
+		hot_buffers[slot] = free_hot.back();
+		free_hot.pop_back();
+	}
+}
+
+template <class Record>
+void BasicBufferTree<Record>::emit_hot(std::vector<ParkedLeaf> &full) {
+	if (full.empty()) return;
+	std::vector<char *> emptied;
+	for (ParkedLeaf &leaf : full) {
+		CircularQueue *cq = queue_for(leaf.key);
+		uint32_t size = prepare_leaf(leaf.data, leaf.size);
+		if (size == 0)
+			emptied.push_back(leaf.data);
+		else if (!park_leaves) {
+			cq->push(leaf.data, size);
+			emptied.push_back(leaf.data);
 		}
-		data_to_read -= len;
-		offset += len;
+		else if (cq->try_push(leaf.data, size))
+			emptied.push_back(leaf.data);
+		else
+			park_leaf(leaf.key, leaf.data, size); // the parked leaf keeps the buffer
+	}
+	std::lock_guard<std::mutex> lk(hot_lock);
+	free_hot.insert(free_hot.end(), emptied.begin(), emptied.end());
+}
+
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::flush_root_data(const char *data, uint32_t size) {
+	FlushScratch *scratch = checkout_scratch();
+	do_flush(data, size, 0, root_router, scratch);
+	return_scratch(scratch);
+	wait_parked();
+}
+
+template <class Record>
+uint32_t BasicBufferTree<Record>::read_back(BufferControlBlock *bcb, char *out, FlushScratch *scratch) {
+	uint32_t size = bcb->size();
+	if (!config.compact) {
+		config.backing_store->read(out, size, bcb->offset());
+		return size;
 	}
+	config.backing_store->read(scratch->encode_buffer, size, bcb->offset());
+	return decode_records<Record>(scratch->encode_buffer, size, bcb->is_leaf(), bcb->min_key, out);
+}
 
-	if (bcb->is_leaf()) { // this is a leaf node
-		cq->push(read_buffers[level-1], bcb->size()); // add the data we read to the circular queue
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::flush_control_block(BufferControlBlock *bcb) {
+	// compact buffers must be decoded so they are never used in place
+	if (config.backing_store->data_at(0) != nullptr && !config.compact) {
+		flush_in_place(bcb);
+		return;
+	}
+	// printf("flushing "); bcb->print();
+	// read the buffer back and reset it. Once reset other writers may
+	// refill the buffer while we push its old contents down the tree.
+	// Only the buffer itself is locked, so independent subtrees flush in parallel
+	bool leaf = bcb->is_leaf();
+	CircularQueue *cq = leaf? queue_for(bcb->min_key) : nullptr;
+	char *slot_data;
+	int slot = -1;
+	bcb->lock();
+	uint32_t data_size = bcb->size();
+	if (leaf && data_size > 0) {
+		// a leaf is read straight into a slot of the circular queue. The slot
+		// is taken without the leaf's lock, so no thread waits on consumers
+		// while holding a buffer that other writers, try_insert's among them, need
+		bcb->unlock();
+		slot = park_leaves? cq->try_reserve(slot_data) : cq->reserve(slot_data);
+		bcb->lock();
+		data_size = bcb->size();
+	}
+	if(data_size == 0) {
+		bcb->unlock();
+		if (slot >= 0) cq->cancel(slot); // another flush emptied the leaf meanwhile
+		return; // don't flush empty control blocks
+	}
 
-		// reset the BufferControlBlock (we have emptied it of data)
-		bcb->reset();
+	if (leaf) {
+		FlushScratch *scratch = config.compact? checkout_scratch() : nullptr;
+		if (slot < 0) {
+			// the queue is full so park the leaf rather than wait
+			slot_data = alloc_pages(config.leaf_size + config.page_size, config.page_size);
+			data_size = read_back(bcb, slot_data, scratch);
+			bcb->reset();
+			bcb->unlock();
+			if (scratch != nullptr) return_scratch(scratch);
+			if ((data_size = prepare_leaf(slot_data, data_size)) == 0)
+				free(slot_data);
+			else
+				park_leaf(bcb->min_key, slot_data, data_size);
+			return;
+		}
+		data_size = read_back(bcb, slot_data, scratch);
+		bcb->reset(); // we have emptied it of data
+		bcb->unlock();
+		if (scratch != nullptr) return_scratch(scratch);
+		// a leaf which cancels out entirely gives its slot back unpublished
+		if ((data_size = prepare_leaf(slot_data, data_size)) == 0)
+			cq->cancel(slot);
+		else
+			cq->commit(slot, data_size);
 		return;
 	}
 
+	FlushScratch *scratch = checkout_scratch();
+	char *read_buffer = scratch->read_buffer;
+
+	data_size = read_back(bcb, read_buffer, scratch);
+	bcb->reset(); // we have emptied it of data
+	bcb->unlock();
+	if (combine_mode == COMBINE_BUFFERS)
+		data_size = combine(read_buffer, data_size, false);
+
 	// printf("read %lu bytes\n", len);
 
-	do_flush(read_buffers[level-1], bcb->size(), bcb->first_child, bcb->min_key, bcb->max_key, bcb->children_num, bcb->level);
+	do_flush(read_buffer, data_size, bcb->first_child, bcb->router, scratch);
+	return_scratch(scratch);
+}
+
+/*
+ * Flush a buffer held in memory without first copying it out. An internal
+ * buffer stays locked while it is partitioned straight from the backing
+ * store. A leaf is handed to the circular queue where it lies and the leaf
+ * moves to a spare extent so that it can keep accepting writes.
+ */
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::flush_in_place(BufferControlBlock *bcb) {
+	bcb->lock();
+	uint32_t data_size = bcb->size();
+	if(data_size == 0) {
+		bcb->unlock();
+		return; // don't flush empty control blocks
+	}
+
+	char *data = config.backing_store->data_at(bcb->offset());
+	if (bcb->is_leaf()) {
+		if ((data_size = prepare_leaf(data, data_size)) == 0) {
+			bcb->reset(); // every update cancelled out
+			bcb->unlock();
+			return;
+		}
+		CircularQueue *cq = queue_for(bcb->min_key);
+		File_Pointer off;
+
+		// the buffers above a leaf flushed in place stay locked until it is
+		// done, so it is never waited on. Without a spare extent or room in
+		// the queue the leaf is copied out and parked, see wait_parked
+		bool moved = try_take_extent(off);
+		if (moved) {
+			bcb->relocate(off);
+			bcb->reset();
+			bcb->unlock();
+			if (cq->try_push_ref(data, data_size))
+				return;
+		}
+		char *copy = (char *) malloc(data_size);
+		memcpy(copy, data, data_size);
+		if (moved) {
+			release_extent(data);
+		} else {
+			bcb->reset();
+			bcb->unlock();
+		}
+		park_leaf(bcb->min_key, copy, data_size);
+		return;
+	}
+
+	if (combine_mode == COMBINE_BUFFERS)
+		data_size = combine(data, data_size, false);
+	FlushScratch *scratch = checkout_scratch();
+	do_flush(data, data_size, bcb->first_child, bcb->router, scratch);
 	bcb->reset();
+	bcb->unlock();
+	return_scratch(scratch);
+}
+
+template <class Record>
+bool BasicBufferTree<Record>::try_take_extent(File_Pointer &off) {
+	std::lock_guard<std::mutex> lk(extent_lock);
+	if (spare_extents.empty()) return false;
+	off = spare_extents.back();
+	spare_extents.pop_back();
+	return true;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::release_extent(const char *data) {
+	std::lock_guard<std::mutex> lk(extent_lock);
+	spare_extents.push_back(data - config.backing_store->data_at(0));
 }
 
 // ask the buffer tree for data
 // this function may sleep until data is available
-bool BufferTree::get_data(data_ret_t &data) {
-	File_Pointer idx = 0;
+template <class Record>
+bool BasicBufferTree<Record>::get_data(data_ret_t &data, int worker, int64_t timeout_us) {
+	lease_t lease;
+	if (!lease_data(lease, worker, timeout_us))
+		return false; // we got no data so return not valid
 
-	// make a request to the circular buffer for data
-	std::pair<int, queue_elm> queue_data;
-	bool got_data = cq->peek(queue_data);
+	try {
+		copy_lease(lease, data);
+	} catch (KeyIncorrectError &e) {
+		release_data(lease);
+		throw;
+	}
+	release_data(lease);
+	return true;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::copy_lease(const lease_t &lease, data_ret_t &data) {
+	data.first = lease.key;
+	data.second.clear(); // remove any old data from the vector
+	data.second.reserve(lease.count()); // reserve space for our updates
+
+	for (uint32_t idx = 0; idx < lease.size; idx += serial_update_size) {
+		const char *upd = lease.data + idx;
+		Node src = Record::load_key(upd);
+		// printf("got update: %lu %lu\n", src, Record::load_dst(upd));
+		if (src != lease.key) {
+			// error to handle some weird unlikely buffer tree shenanigans
+			printf("source node %lu and key %lu do not match in get_data()\n", src, lease.key);
+			throw KeyIncorrectError();
+		}
+
+		// printf("query to node %lu got edge to node %lu\n", key, Record::load_dst(upd));
+		data.second.push_back(Record::load_value(upd));
+	}
+}
+
+template <class Record>
+bool BasicBufferTree<Record>::get_data_batch(std::vector<data_ret_t> &data, size_t max_leaves, uint64_t max_bytes,
+  int worker, int64_t timeout_us) {
+	static thread_local std::vector<lease_t> leases;
+	if (!lease_data_batch(leases, max_leaves, max_bytes, worker, timeout_us))
+		return false;
 
-	if (!got_data)
+	data.resize(leases.size());
+	try {
+		for (size_t i = 0; i < leases.size(); i++)
+			copy_lease(leases[i], data[i]);
+	} catch (KeyIncorrectError &e) {
+		release_data_batch(leases);
+		throw;
+	}
+	release_data_batch(leases);
+	return true;
+}
+
+template <class Record>
+bool BasicBufferTree<Record>::lease_data_batch(std::vector<lease_t> &leases, size_t max_leaves, uint64_t max_bytes,
+  int worker, int64_t timeout_us) {
+	static thread_local std::vector<std::pair<int, queue_elm>> elms;
+	elms.resize(max_leaves);
+	leases.clear();
+
+	int queue;
+	int n = take_leaves(elms.data(), max_leaves, max_bytes, worker, queue, timeout_us);
+	if (n == 0)
 		return false; // we got no data so return not valid
 
-	int i         = queue_data.first;
-	queue_elm elm = queue_data.second;
-	char *serial_data = elm.data;
-	uint32_t len      = elm.size;
+	leases.resize(n);
+	for (int i = 0; i < n; i++) {
+		lease_t &lease = leases[i];
+		lease.queue    = queue;
+		lease.slot     = elms[i].first;
+		lease.borrowed = elms[i].second.borrowed;
+		lease.data     = elms[i].second.data;
+		lease.size     = elms[i].second.size;
+		lease.key      = (lease.size > 0)? load_key(lease.data) : 0;
+	}
+	return true;
+}
+
+template <class Record>
+void BasicBufferTree<Record>::release_data_batch(std::vector<lease_t> &leases) {
+	if (leases.empty()) return;
+	for (lease_t &lease : leases) {
+		if (lease.borrowed) release_extent(lease.data);
+	}
+	// the leases hold a run of consecutive slots
+	queues[leases[0].queue]->pop_batch(leases[0].slot, leases.size());
+	leases.clear();
+	if (parked_bytes > 0) drain_parked(false);
+}
 
-	if (len == 0) {
-		cq->pop(i);
+template <class Record>
+bool BasicBufferTree<Record>::lease_data(lease_t &lease, int worker, int64_t timeout_us) {
+	// make a request to the circular buffer for data
+	std::pair<int, queue_elm> queue_data;
+	int queue;
+	if (take_leaves(&queue_data, 1, config.leaf_size + config.page_size, worker, queue, timeout_us) == 0)
 		return false; // we got no data so return not valid
-        }
 
-	data.second.clear(); // remove any old data from the vector
-	uint32_t vec_len  = len / serial_update_size;
-	data.second.reserve(vec_len); // reserve space for our updates
+	queue_elm elm  = queue_data.second;
+	lease.queue    = queue;
+	lease.slot     = queue_data.first;
+	lease.borrowed = elm.borrowed;
+	lease.data     = elm.data;
+	lease.size     = elm.size;
+
+	if (lease.size == 0) {
+		release_data(lease);
+		return false; // we got no data so return not valid
+	}
 
 	// assume the first key is correct so extract it
-	Node key = load_key(serial_data);
-	data.first = key;
+	lease.key = load_key(lease.data);
+	return true;
+}
 
-	while(idx < (uint64_t) len) {
-		update_t upd = deserialize_update(serial_data + idx);
-		// printf("got update: %lu %lu\n", upd.first, upd.second);
-		if (upd.first == 0 && upd.second == 0) {
-			break; // got a null entry so done
-		}
+template <class Record>
+int BasicBufferTree<Record>::take_leaves(std::pair<int, queue_elm> *elms, int max, uint64_t max_bytes,
+  int worker, int &queue, int64_t timeout_us) {
+	if (parked_bytes > 0) drain_parked(false);
+	int num_queues = queues.size();
+	queue = (num_queues == 1)? 0 : worker % num_queues;
+	if (num_queues == 1)
+		return queues[0]->peek_batch(elms, max, max_bytes, timeout_us);
 
-		if (upd.first != key) {
-			// error to handle some weird unlikely buffer tree shenanigans
-			printf("source node %lu and key %lu do not match in get_data()\n", upd.first, key);
-			throw KeyIncorrectError();
+	int own = queue;
+	while (true) {
+		// a leaf pushed to another queue just before non_block was set is
+		// only seen by a pass which starts after it, so look once more
+		bool last_pass = non_block;
+		int n = queues[own]->peek_batch(elms, max, max_bytes, 0);
+		if (n > 0) return n;
+
+		// our own queue is empty so help out the other consumers
+		for (int k = 1; k < num_queues; k++) {
+			queue = (own + k) % num_queues;
+			n = queues[queue]->peek_batch(elms, max, max_bytes, 0);
+			if (n > 0) return n;
 		}
+		if (last_pass) return 0;
 
-		// printf("query to node %lu got edge to node %lu\n", key, upd.second);
-		data.second.push_back(upd.second);
-		idx += serial_update_size;
+		// nothing to steal either. Wait on our own queue for a while
+		queue = own;
+		n = queues[own]->peek_batch(elms, max, max_bytes, (timeout_us >= 0)? timeout_us : steal_poll_us);
+		if (n > 0) return n;
+		if (timeout_us >= 0) return 0;
 	}
+}
 
-	cq->pop(i); // mark the cq entry as clean
-	return true;
+template <class Record>
+void BasicBufferTree<Record>::release_data(lease_t &lease) {
+	if (lease.borrowed) release_extent(lease.data);
+	queues[lease.queue]->pop(lease.slot); // mark the cq entry as clean
+	if (parked_bytes > 0) drain_parked(false);
 }
 
-flush_ret_t BufferTree::force_flush() {
+template <class Record>
+flush_ret_t BasicBufferTree<Record>::force_flush() {
 	// printf("Force flush\n");
-	flush_root();
-	// loop through each of the bufferControlBlocks and flush it
-	// looping from 0 on should force a top to bottom flush (if we do this right)
-	
-	for (BufferControlBlock *bcb : buffers) {
-		if (bcb != nullptr) {
-			flush_control_block(bcb);
+	std::lock_guard<std::mutex> lk(shard_lock);
+	for (auto &entry : shards) {
+		RootShard *shard = entry.second;
+		wait_root_flushed(shard);
+		flush_shard_data(shard, shard->buffer, shard->position);
+		shard->position = 0;
+	}
+	if (hot_keys != nullptr) {
+		std::vector<ParkedLeaf> full;
+		{
+			std::lock_guard<std::mutex> hot_lk(hot_lock);
+			for (uint32_t slot = 0; slot < hot_keys->size(); slot++)
+				take_hot(slot, hot_keys->key_of(slot), full);
 		}
+		emit_hot(full);
 	}
-}
 
-void BufferTree::set_non_block(bool block) {
-	if (block) {
-		cq->no_block = true; // circular queue operations should no longer block
-		cq->cirq_empty.notify_all();
-		cq->cirq_full.notify_all();
+	bool empty = false;
+	while (!empty) {
+		if (scheduler != nullptr)
+			scheduler->wait_idle();
+
+		// loop through each of the bufferControlBlocks and flush it
+		// looping from 0 on should force a top to bottom flush (if we do this right)
+		for (BufferControlBlock *bcb : buffers) {
+			if (bcb != nullptr) {
+				flush_control_block(bcb);
+			}
+		}
+		if (scheduler == nullptr)
+			break;
+
+		// flushes queued during the loop may have pushed data into buffers
+		// we already passed, so go again until the whole tree is empty
+		scheduler->wait_idle();
+		empty = true;
+		for (BufferControlBlock *bcb : buffers) {
+			if (bcb != nullptr && bcb->size() > 0) {
+				empty = false;
+				break;
+			}
+		}
 	}
-	else {
-		cq->no_block = false; // set circular queue to block if necessary
+	// and every parked leaf is queued, even those another drain has in hand
+	while (parked_bytes > 0)
+		drain_parked(true);
+}
+
+template <class Record>
+void BasicBufferTree<Record>::set_non_block(bool block) {
+	// when set circular queue operations should no longer block
+	non_block = block;
+	for (CircularQueue *cq : queues)
+		cq->set_no_block(block);
+}
+
+template <class Record>
+queue_stats_t BasicBufferTree<Record>::get_queue_stats() {
+	queue_stats_t total = {0, 0, 0, 0, 0};
+	for (CircularQueue *cq : queues) {
+		queue_stats_t stats = cq->get_stats();
+		total.producer_blocked_ns += stats.producer_blocked_ns;
+		total.producer_blocks     += stats.producer_blocks;
+		total.depth_bytes         += stats.depth_bytes;
+		total.grows               += stats.grows;
+		total.shrinks             += stats.shrinks;
 	}
+	return total;
+}
+
+template <class Record>
+uint64_t BasicBufferTree<Record>::get_bytes_written() {
+	std::lock_guard<std::mutex> lk(scratch_lock);
+	return bytes_written;
 }
+
+template class BasicBufferTree<NodeRecord>;
+template class BasicBufferTree<Node32Record>;
+template class BasicBufferTree<WeightedRecord>;
@@ -1,86 +1,579 @@
 #include "../include/circular_queue.h"
 #include "../include/update.h"
 #include "../include/buffer_tree.h"
+#include "../include/numa_binding.h"
 
 #include <string.h>
+#include <algorithm>
+#include <climits>
 #include <chrono>
+#include <thread>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
-CircularQueue::CircularQueue(int num_elements, int size_of_elm): 
-  len(num_elements), elm_size(size_of_elm) {
-	head = 0;
-	tail = 0;
-	no_block = false;
+// how many times to check before going to sleep. Spinning on a single
+// core only keeps the thread we are waiting on from running
+static const int spin_limit = (std::thread::hardware_concurrency() > 1)? 1024 : 0;
 
-	// malloc the memory for the circular queue
-	queue_array = (queue_elm *) malloc(sizeof(queue_elm) * len);
-	data_array = (char *) malloc(elm_size * len * sizeof(char));
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// sleep while word still holds val, or until woken or timeout_us passes
+static inline void futex_wait(std::atomic<uint32_t> *word, uint32_t val, int64_t timeout_us) {
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec  = timeout_us / 1000000;
+	ts.tv_nsec = (timeout_us % 1000000) * 1000;
+	syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT_PRIVATE, val, 
+	  (timeout_us < 0)? nullptr : &ts, nullptr, 0);
+#else
+	(void) word; (void) val; (void) timeout_us;
+	std::this_thread::yield();
+#endif
+}
+
+static inline void futex_wake(std::atomic<uint32_t> *word, int count) {
+#ifdef __linux__
+	syscall(SYS_futex, (uint32_t *) word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+	(void) word; (void) count;
+#endif
+}
+
+static inline int64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CircularQueue::CircularQueue(int num_elements, int size_of_elm, int max_elements): 
+  len(std::max(num_elements, max_elements)), elm_size(size_of_elm) {
+	head             = 0;
+	tail             = 0;
+	free_head        = 0;
+	free_tail        = 0;
+	data_epoch       = 0;
+	data_waiters     = 0;
+	space_epoch      = 0;
+	space_waiters    = 0;
+	no_block         = false;
+	numa_node        = -1;
+	depth            = num_elements;
+	allocated        = 0;
+	lent             = 0;
+	min_depth        = num_elements;
+	adaptive         = max_elements > num_elements;
+	in_use           = 0;
+	peak_in_use      = 0;
+	blocked_recently = false;
+	last_adapt_ns    = now_ns();
+	blocked_ns       = 0;
+	blocks           = 0;
+	grows            = 0;
+	shrinks          = 0;
+
+	// the ring and the free list have room for the largest the queue may grow
+	// to. Buffers are allocated as they are first needed
+	slots      = new Slot[len];
+	free_slots = new FreeSlot[len];
 	for (int i = 0; i < len; i++) {
-		queue_array[i].data    = data_array + (elm_size * i);
-		queue_array[i].dirty   = false;
-		queue_array[i].touched = false;
-		queue_array[i].size    = 0;
+		slots[i].seq          = i; // ready for the i-th push
+		slots[i].size         = 0;
+		slots[i].elm.data     = nullptr;
+		slots[i].elm.size     = 0;
+		slots[i].elm.borrowed = false;
+		free_slots[i].seq     = i;
+		free_slots[i].buf     = nullptr;
 	}
 
-	printf("CQ: created circular queue with %i elements each of size %i\n", len, elm_size);
+	printf("CQ: created circular queue with %i elements each of size %i\n", num_elements, elm_size);
 }
 
 CircularQueue::~CircularQueue() {
 	// free the queue
-	free(data_array);
-	free(queue_array);
+	for (char *buf : all_buffers)
+		free(buf);
+	delete[] slots;
+	delete[] free_slots;
 }
 
 void CircularQueue::push(char *elm, int size) {
+	push_elm(elm, size, false, true);
+}
+
+void CircularQueue::push_ref(char *elm, int size) {
+	push_elm(elm, size, true, true);
+}
+
+bool CircularQueue::try_push(char *elm, int size) {
+	return push_elm(elm, size, false, false);
+}
+
+bool CircularQueue::try_push_ref(char *elm, int size) {
+	return push_elm(elm, size, true, false);
+}
+
+bool CircularQueue::push_elm(char *elm, int size, bool borrow, bool may_block) {
 	if(size > elm_size) {
 		printf("write of size %i bytes greater than max of %i\n", size, elm_size);
 		throw WriteTooBig();
 	}
 
+	char *data = elm;
+	if (borrow) {
+		if (!get_lent(may_block)) return false;
+	} else {
+		data = get_buffer(may_block);
+		if (data == nullptr) return false;
+		memcpy(data, elm, size);
+	}
+	uint64_t pos;
+	if (!claim(pos, may_block)) {
+		// the room we took may be what another producer is waiting for
+		if (borrow) put_lent();
+		else put_buffer(data);
+		wake(space_epoch, space_waiters);
+		return false;
+	}
+	Slot *slot   = &slots[pos % len];
+	slot->elm.data     = data;
+	slot->elm.size     = size;
+	slot->elm.borrowed = borrow;
+	slot->size.store(size, std::memory_order_relaxed);
+
+	// publish the slot to consumers
+	slot->seq.store(pos + 1, std::memory_order_release);
+	wake(data_epoch, data_waiters);
+	return true;
+}
+
+int CircularQueue::reserve(char *&data) {
+	return reserve_slot(data, true);
+}
+
+int CircularQueue::try_reserve(char *&data) {
+	return reserve_slot(data, false);
+}
+
+int CircularQueue::reserve_slot(char *&data, bool may_block) {
+	data = get_buffer(may_block);
+	if (data == nullptr) return -1;
+	uint64_t pos;
+	if (!claim(pos, may_block)) {
+		put_buffer(data);
+		wake(space_epoch, space_waiters);
+		return -1;
+	}
+	int i = pos % len;
+	slots[i].elm.data = data;
+	return i;
+}
+
+void CircularQueue::commit(int i, int size) {
+	if(size > elm_size) {
+		printf("write of size %i bytes greater than max of %i\n", size, elm_size);
+		throw WriteTooBig();
+	}
+
+	Slot *slot         = &slots[i];
+	slot->elm.size     = size;
+	slot->elm.borrowed = false;
+	slot->size.store(size, std::memory_order_relaxed);
+
+	// the slot's sequence still holds the position it was claimed at
+	uint64_t pos = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(pos + 1, std::memory_order_release);
+	wake(data_epoch, data_waiters);
+}
+
+void CircularQueue::cancel(int i) {
+	Slot *slot         = &slots[i];
+	slot->elm.size     = 0;
+	slot->elm.borrowed = false;
+	slot->size.store(cancelled_size, std::memory_order_relaxed);
+
+	// publish the slot so that a consumer pops it, returning its buffer
+	uint64_t pos = slot->seq.load(std::memory_order_relaxed);
+	slot->seq.store(pos + 1, std::memory_order_release);
+	wake(data_epoch, data_waiters);
+}
+
+bool CircularQueue::claim(uint64_t &pos, bool may_block) {
+	// claim the slot at head once the consumers are done with it
+	pos = head.load(std::memory_order_relaxed);
+	while(true) {
+		Slot *slot = &slots[pos % len];
+		int64_t dif = (int64_t) (slot->seq.load(std::memory_order_acquire) - pos);
+		if (dif == 0) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return true;
+		}
+		else if (dif < 0) { // full
+			if (!may_block) return false;
+			wait(space_epoch, space_waiters, [this]{return !full();});
+			pos = head.load(std::memory_order_relaxed);
+		}
+		else // another producer got here first
+			pos = head.load(std::memory_order_relaxed);
+	}
+}
+
+bool CircularQueue::peek(std::pair<int, queue_elm> &ret, int64_t timeout_us) {
+	return peek_batch(&ret, 1, elm_size, timeout_us) == 1;
+}
+
+void CircularQueue::pop(int i) {
+	pop_batch(i, 1);
+}
+
+int CircularQueue::peek_batch(std::pair<int, queue_elm> *ret, int max_elms, uint64_t max_bytes,
+  int64_t timeout_us) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+	uint64_t pos = tail.load(std::memory_order_relaxed);
 	while(true) {
-		std::unique_lock<std::mutex> lk(write_lock);
-		// printf("CQ: push: wait on not-full. full() = %s\n", (full())? "true" : "false");
-		cirq_full.wait_for(lk, std::chrono::seconds(2), [this]{return !full();});
-		if(!full()) {
-			memcpy(queue_array[head].data, elm, size);
-			queue_array[head].dirty = true;
-			queue_array[head].size = size;
-			head = incr(head);
-			lk.unlock();
-			cirq_empty.notify_one();
+		// count the run of published elements starting at tail. Until the
+		// run is claimed another consumer may pop and a producer refill
+		// these slots, so only their atomic sizes are looked at
+		int n = 0;
+		uint64_t bytes = 0;
+		bool cancelled = false;
+		while (n < max_elms && n < len) {
+			Slot *slot = &slots[(pos + n) % len];
+			if (slot->seq.load(std::memory_order_acquire) != pos + n + 1)
+				break;
+			uint32_t size = slot->size.load(std::memory_order_relaxed);
+			if (size == cancelled_size) { // a run ends before a cancelled slot
+				cancelled = (n == 0);
+				break;
+			}
+			if (n > 0 && bytes + size > max_bytes)
+				break;
+			bytes += size;
+			n++;
+		}
+
+		if (cancelled) {
+			// nothing was published in this slot, so pop it and look on
+			if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				pop_batch(pos % len, 1);
+				pos++;
+			}
+			continue;
+		}
+
+		if (n > 0) {
+			// the run is ours if no other consumer has moved tail, in which
+			// case none of its slots were recycled while we counted
+			if (tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+				for (int k = 0; k < n; k++) {
+					ret[k].first  = (pos + k) % len;
+					ret[k].second = slots[(pos + k) % len].elm;
+				}
+				return n;
+			}
+			continue;
+		}
+
+		int64_t dif = (int64_t) (slots[pos % len].seq.load(std::memory_order_acquire) - (pos + 1));
+		if (dif < 0) { // empty
+			maybe_shrink(); // an idle queue does not pop
+			if (no_block || timeout_us == 0)
+				return 0;
+			int64_t remaining = -1;
+			if (timeout_us > 0) {
+				remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+				  deadline - std::chrono::steady_clock::now()).count();
+				if (remaining <= 0)
+					return 0;
+			}
+			wait(data_epoch, data_waiters, [this]{return !empty() || no_block;}, remaining);
+		}
+		pos = tail.load(std::memory_order_relaxed);
+	}
+}
+
+void CircularQueue::pop_batch(int first, int count) {
+	// this data has been processed and these slots may now be overwritten
+	// by the push one lap of the ring after the one which filled them
+	for (int k = 0; k < count; k++) {
+		Slot *slot = &slots[(first + k) % len];
+		if (slot->elm.borrowed)
+			put_lent();
+		else
+			put_buffer(slot->elm.data);
+		uint64_t seq = slot->seq.load(std::memory_order_relaxed);
+		slot->seq.store(seq + len - 1, std::memory_order_release);
+	}
+	wake(space_epoch, space_waiters, count);
+	maybe_shrink();
+}
+
+char *CircularQueue::get_buffer(bool may_block) {
+	int64_t wait_start = 0;
+	char *buf;
+	while ((buf = free_pop()) == nullptr) {
+		uint32_t a = allocated.load();
+		if (a + lent.load() < depth.load()) {
+			if (allocated.compare_exchange_weak(a, a + 1)) {
+				buf = new_buffer();
+				break;
+			}
+			continue;
+		}
+		if (grow())
+			continue;
+
+		// every buffer is holding an element so wait for a pop
+		if (!may_block) return nullptr;
+		if (wait_start == 0) {
+			wait_start = now_ns();
+			blocks++;
+		}
+		blocked_recently = true;
+		wait(space_epoch, space_waiters, [this]{return !free_empty() || allocated + lent < depth;});
+	}
+	if (wait_start != 0)
+		blocked_ns += now_ns() - wait_start;
+
+	if (adaptive) {
+		uint32_t used = in_use.fetch_add(1) + 1;
+		uint32_t peak = peak_in_use.load();
+		while (used > peak && !peak_in_use.compare_exchange_weak(peak, used)) {}
+	}
+	return buf;
+}
+
+bool CircularQueue::get_lent(bool may_block) {
+	int64_t wait_start = 0;
+	while (true) {
+		uint32_t l = lent.load();
+		if (allocated.load() + l < depth.load()) {
+			if (lent.compare_exchange_weak(l, l + 1))
+				break;
+			continue;
+		}
+
+		// a buffer sitting in the free list gives up its share of the depth
+		char *buf = free_pop();
+		if (buf != nullptr) {
+			allocated.fetch_sub(1);
+			delete_buffer(buf);
+			continue;
+		}
+		if (grow())
+			continue;
+
+		if (!may_block) return false;
+		if (wait_start == 0) {
+			wait_start = now_ns();
+			blocks++;
+		}
+		blocked_recently = true;
+		wait(space_epoch, space_waiters, [this]{return !free_empty() || allocated + lent < depth;});
+	}
+	if (wait_start != 0)
+		blocked_ns += now_ns() - wait_start;
+
+	if (adaptive) {
+		uint32_t used = in_use.fetch_add(1) + 1;
+		uint32_t peak = peak_in_use.load();
+		while (used > peak && !peak_in_use.compare_exchange_weak(peak, used)) {}
+	}
+	return true;
+}
+
+void CircularQueue::put_lent() {
+	if (adaptive)
+		in_use.fetch_sub(1);
+	lent.fetch_sub(1);
+}
+
+void CircularQueue::put_buffer(char *buf) {
+	if (adaptive)
+		in_use.fetch_sub(1);
+
+	// a queue which has shrunk frees buffers until few enough remain
+	uint32_t a = allocated.load();
+	while (a + lent.load() > depth.load()) {
+		if (allocated.compare_exchange_weak(a, a - 1)) {
+			delete_buffer(buf);
+			return;
+		}
+	}
+	free_push(buf);
+}
+
+char *CircularQueue::new_buffer() {
+	char *buf;
+	if (posix_memalign((void **) &buf, sysconf(_SC_PAGE_SIZE), elm_size) != 0) {
+		printf("ERROR: failed to allocate circular queue\n");
+		exit(EXIT_FAILURE);
+	}
+	if (numa_node >= 0) place_on_numa_node(buf, elm_size, numa_node);
+	std::lock_guard<std::mutex> lk(alloc_lock);
+	all_buffers.push_back(buf);
+	return buf;
+}
+
+void CircularQueue::delete_buffer(char *buf) {
+	std::lock_guard<std::mutex> lk(alloc_lock);
+	for (size_t i = 0; i < all_buffers.size(); i++) {
+		if (all_buffers[i] == buf) {
+			all_buffers[i] = all_buffers.back();
+			all_buffers.pop_back();
 			break;
 		}
-		lk.unlock();
 	}
+	free(buf);
 }
 
-bool CircularQueue::peek(std::pair<int, queue_elm> &ret) {
-	do {
-		std::unique_lock<std::mutex> lk(read_lock);
-		cirq_empty.wait_for(lk, std::chrono::seconds(2), [this]{return (!empty() || no_block);});
-		if(!empty()) {
-			int temp = tail;
-			queue_array[tail].touched = true;
-			tail = incr(tail);
-			lk.unlock();
+// the free list holds at most len buffers so a push never finds it full
+bool CircularQueue::free_push(char *buf) {
+	uint64_t pos = free_head.load(std::memory_order_relaxed);
+	while (true) {
+		FreeSlot *slot = &free_slots[pos % len];
+		int64_t dif = (int64_t) (slot->seq.load(std::memory_order_acquire) - pos);
+		if (dif == 0) {
+			if (free_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot->buf = buf;
+				slot->seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (dif < 0)
+			return false;
+		else
+			pos = free_head.load(std::memory_order_relaxed);
+	}
+}
+
+char *CircularQueue::free_pop() {
+	uint64_t pos = free_tail.load(std::memory_order_relaxed);
+	while (true) {
+		FreeSlot *slot = &free_slots[pos % len];
+		int64_t dif = (int64_t) (slot->seq.load(std::memory_order_acquire) - (pos + 1));
+		if (dif == 0) {
+			if (free_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				char *buf = slot->buf;
+				slot->seq.store(pos + len, std::memory_order_release);
+				return buf;
+			}
+		}
+		else if (dif < 0)
+			return nullptr;
+		else
+			pos = free_tail.load(std::memory_order_relaxed);
+	}
+}
 
-			ret.first = temp;
-			ret.second = queue_array[temp];
+bool CircularQueue::free_empty() {
+	uint64_t pos = free_tail.load(std::memory_order_relaxed);
+	return (int64_t) (free_slots[pos % len].seq.load(std::memory_order_acquire) - (pos + 1)) < 0;
+}
+
+bool CircularQueue::grow() {
+	if (!adaptive) return false;
+	uint32_t d = depth.load();
+	while (d < (uint32_t) len) {
+		uint32_t to = std::min<uint32_t>(len, d + std::max<uint32_t>(1, d / 2));
+		if (depth.compare_exchange_weak(d, to)) {
+			grows++;
 			return true;
 		}
-		lk.unlock();
-	}while(!no_block);
+	}
 	return false;
 }
 
-void CircularQueue::pop(int i) {
-	write_lock.lock();
-	queue_array[i].dirty   = false; // this data has been processed and this slot may now be overwritten
-	queue_array[i].touched = false; // may read this slot
-	write_lock.unlock();
-	cirq_full.notify_one();
+void CircularQueue::maybe_shrink() {
+	if (!adaptive) return;
+	int64_t now  = now_ns();
+	int64_t last = last_adapt_ns.load();
+	if (now - last < adapt_interval_ns || !last_adapt_ns.compare_exchange_strong(last, now))
+		return;
+
+	// shrink if no producer waited and under half the buffers were ever in use
+	uint32_t peak = peak_in_use.exchange(in_use.load());
+	if (blocked_recently.exchange(false))
+		return;
+	uint32_t d = depth.load();
+	if (d <= min_depth || peak >= d / 2)
+		return;
+	uint32_t to = std::max(min_depth, std::max(2 * peak, d - d / 4));
+	if (!depth.compare_exchange_strong(d, to))
+		return;
+	shrinks++;
+
+	// free the buffers no longer needed which are not holding elements
+	uint32_t a = allocated.load();
+	while (a + lent.load() > to) {
+		char *buf = free_pop();
+		if (buf == nullptr)
+			break;
+		if (allocated.compare_exchange_strong(a, a - 1))
+			delete_buffer(buf);
+		else
+			free_push(buf);
+		a = allocated.load();
+	}
+}
+
+queue_stats_t CircularQueue::get_stats() {
+	queue_stats_t stats;
+	stats.producer_blocked_ns = blocked_ns;
+	stats.producer_blocks     = blocks;
+	stats.depth_bytes         = (uint64_t) depth * elm_size;
+	stats.grows               = grows;
+	stats.shrinks             = shrinks;
+	return stats;
+}
+
+void CircularQueue::set_no_block(bool non_block) {
+	no_block = non_block;
+	if (non_block) {
+		wake(data_epoch, data_waiters, INT_MAX);
+		wake(space_epoch, space_waiters, INT_MAX);
+	}
+}
+
+bool CircularQueue::full() {
+	uint64_t pos = head.load(std::memory_order_relaxed);
+	return (int64_t) (slots[pos % len].seq.load(std::memory_order_acquire) - pos) < 0;
+}
+
+bool CircularQueue::empty() {
+	uint64_t pos = tail.load(std::memory_order_relaxed);
+	return (int64_t) (slots[pos % len].seq.load(std::memory_order_acquire) - (pos + 1)) < 0;
+}
+
+template <class Ready>
+void CircularQueue::wait(std::atomic<uint32_t> &epoch, std::atomic<uint32_t> &waiters, Ready ready,
+  int64_t timeout_us) {
+	for (int i = 0; i < spin_limit; i++) {
+		if (ready()) return;
+		cpu_relax();
+	}
+
+	// announce ourselves before checking again so that a wake() which
+	// comes after the check sees us and bumps the epoch we sleep on
+	waiters.fetch_add(1);
+	uint32_t e = epoch.load();
+	if (!ready())
+		futex_wait(&epoch, e, timeout_us);
+	waiters.fetch_sub(1);
+}
+
+void CircularQueue::wake(std::atomic<uint32_t> &epoch, std::atomic<uint32_t> &waiters, int count) {
+	epoch.fetch_add(1);
+	if (waiters.load() > 0)
+		futex_wake(&epoch, count);
 }
 
 void CircularQueue::print() {
-	printf("head=%i, tail=%i, is_full=%s, is_empty=%s\n", 
-		head, tail, full()? "true" : "false", empty()? "true" : "false");
+	printf("head=%lu, tail=%lu, is_full=%s, is_empty=%s\n", 
+		head.load(), tail.load(), full()? "true" : "false", empty()? "true" : "false");
 }
@@ -0,0 +1,179 @@
+#include "../include/compact_codec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+static inline char *put_varint(char *out, uint64_t v) {
+	while (v >= 0x80) {
+		*out++ = (char) (v | 0x80);
+		v >>= 7;
+	}
+	*out++ = (char) v;
+	return out;
+}
+
+static inline const char *get_varint(const char *in, uint64_t &v) {
+	v = 0;
+	for (int shift = 0; ; shift += 7) {
+		uint8_t b = *in++;
+		v |= (uint64_t) (b & 0x7F) << shift;
+		if (b < 0x80) return in;
+	}
+}
+
+// an update copied as a single fixed size value
+template <uint32_t size>
+struct raw_record {
+	char bytes[size];
+};
+
+template <class Record>
+void radix_sort_records(char *data, size_t n, bool by_source, bool by_payload) {
+	typedef raw_record<Record::size> rec_t;
+	static thread_local std::vector<rec_t> temp;
+	if (n < 2) return;
+	if (temp.size() < n) temp.resize(n);
+
+	// the bytes to sort on from least to most significant. Payload,
+	// destination and then key, each stored little endian
+	const uint32_t dst_start = Record::key_size;
+	const uint32_t dst_end   = Record::key_size + Record::dst_size;
+	uint32_t digit_byte[Record::size];
+	uint32_t digits = 0;
+	if (by_payload) {
+		for (uint32_t b = dst_end; b < Record::size; b++) digit_byte[digits++] = b;
+	}
+	for (uint32_t b = dst_start; b < dst_end; b++) digit_byte[digits++] = b;
+	if (by_source) {
+		for (uint32_t b = 0; b < Record::key_size; b++) digit_byte[digits++] = b;
+	}
+
+	rec_t *src = reinterpret_cast<rec_t *>(data);
+	rec_t *dst = temp.data();
+	std::vector<uint32_t> counts(digits * 256, 0);
+	for (size_t i = 0; i < n; i++) {
+		const uint8_t *bytes = reinterpret_cast<const uint8_t *>(src[i].bytes);
+		for (uint32_t d = 0; d < digits; d++)
+			counts[d * 256 + bytes[digit_byte[d]]]++;
+	}
+
+	for (uint32_t d = 0; d < digits; d++) {
+		uint32_t *count = &counts[d * 256];
+		uint32_t b      = digit_byte[d];
+		if (count[(uint8_t) src[0].bytes[b]] == n)
+			continue; // every update has the same byte here
+
+		size_t pos = 0;
+		for (uint32_t v = 0; v < 256; v++) {
+			uint32_t c = count[v];
+			count[v] = pos;
+			pos += c;
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[count[(uint8_t) src[i].bytes[b]]++] = src[i];
+		std::swap(src, dst);
+	}
+	if (src != reinterpret_cast<rec_t *>(data))
+		std::copy(src, src + n, reinterpret_cast<rec_t *>(data));
+}
+
+template <class Record>
+uint32_t encode_records(char *data, size_t n, bool leaf, char *out) {
+	const uint32_t payload = Record::value_size - Record::dst_size;
+	radix_sort_records<Record>(data, n, !leaf, false);
+
+	// the raw form, in case the encoding does not pay
+	char *raw = put_varint(out, (n << 1) | 1);
+	if (leaf) {
+		for (size_t i = 0; i < n; i++, raw += Record::value_size)
+			memcpy(raw, data + i * Record::size + Record::key_size, Record::value_size);
+	} else {
+		memcpy(raw, data, n * Record::size);
+		raw += n * Record::size;
+	}
+	uint32_t raw_size = raw - out;
+
+	// encode to the side and give up as soon as the encoding is no smaller
+	// than the raw form
+	static thread_local std::vector<char> enc;
+	if (enc.size() < raw_size) enc.resize(raw_size + max_block_header);
+	char *pos = put_varint(enc.data(), n << 1);
+	Node prev_src = 0;
+	Node prev_dst = 0;
+	for (size_t i = 0; i < n; i++) {
+		if ((uint32_t) (pos - enc.data()) + 2 * max_block_header + payload >= raw_size)
+			return raw_size;
+		const char *rec = data + i * Record::size;
+		Node src = Record::load_key(rec);
+		Node dst = Record::load_dst(rec);
+		if (!leaf) {
+			pos = put_varint(pos, src - prev_src);
+			if (src != prev_src) prev_dst = 0;
+			prev_src = src;
+		}
+		pos = put_varint(pos, dst - prev_dst);
+		prev_dst = dst;
+		memcpy(pos, rec + Record::key_size + Record::dst_size, payload);
+		pos += payload;
+	}
+	uint32_t enc_size = pos - enc.data();
+	memcpy(out, enc.data(), enc_size);
+	return enc_size;
+}
+
+template <class Record>
+uint32_t decode_records(const char *in, uint32_t size, bool leaf, Node key, char *out) {
+	const uint32_t payload = Record::value_size - Record::dst_size;
+	const char *end = in + size;
+	char *start = out;
+	typename Record::key_t leaf_key = key;
+	while (in < end) {
+		uint64_t header;
+		in = get_varint(in, header);
+		uint64_t n = header >> 1;
+		if (header & 1) {
+			// stored as is
+			if (leaf) {
+				for (uint64_t i = 0; i < n; i++, in += Record::value_size, out += Record::size) {
+					memcpy(out, &leaf_key, Record::key_size);
+					memcpy(out + Record::key_size, in, Record::value_size);
+				}
+			} else {
+				memcpy(out, in, n * Record::size);
+				in  += n * Record::size;
+				out += n * Record::size;
+			}
+			continue;
+		}
+
+		Node src = leaf? key : 0;
+		Node dst = 0;
+		for (uint64_t i = 0; i < n; i++, out += Record::size) {
+			uint64_t delta;
+			if (!leaf) {
+				in = get_varint(in, delta);
+				if (delta != 0) dst = 0;
+				src += delta;
+			}
+			in = get_varint(in, delta);
+			dst += delta;
+			typename Record::key_t src_key = src;
+			memcpy(out, &src_key, Record::key_size);
+			memcpy(out + Record::key_size, &dst, Record::dst_size);
+			memcpy(out + Record::key_size + Record::dst_size, in, payload);
+			in += payload;
+		}
+	}
+	return out - start;
+}
+
+template void radix_sort_records<NodeRecord>(char *data, size_t n, bool by_source, bool by_payload);
+template void radix_sort_records<Node32Record>(char *data, size_t n, bool by_source, bool by_payload);
+template void radix_sort_records<WeightedRecord>(char *data, size_t n, bool by_source, bool by_payload);
+template uint32_t encode_records<NodeRecord>(char *data, size_t n, bool leaf, char *out);
+template uint32_t encode_records<Node32Record>(char *data, size_t n, bool leaf, char *out);
+template uint32_t encode_records<WeightedRecord>(char *data, size_t n, bool leaf, char *out);
+template uint32_t decode_records<NodeRecord>(const char *in, uint32_t size, bool leaf, Node key, char *out);
+template uint32_t decode_records<Node32Record>(const char *in, uint32_t size, bool leaf, Node key, char *out);
+template uint32_t decode_records<WeightedRecord>(const char *in, uint32_t size, bool leaf, Node key, char *out);
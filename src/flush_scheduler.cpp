@@ -0,0 +1,53 @@
+#include "../include/flush_scheduler.h"
+
+FlushScheduler::FlushScheduler(int num_threads, flush_task_t on_start) : running(0), shutdown(false) {
+	for (int i = 0; i < num_threads; i++) {
+		workers.emplace_back(&FlushScheduler::do_work, this, on_start);
+	}
+}
+
+FlushScheduler::~FlushScheduler() {
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		shutdown = true;
+	}
+	work.notify_all();
+	for (std::thread &t : workers) {
+		t.join();
+	}
+}
+
+void FlushScheduler::submit(flush_task_t task) {
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		tasks.push_back(std::move(task));
+	}
+	work.notify_one();
+}
+
+void FlushScheduler::wait_idle() {
+	std::unique_lock<std::mutex> lk(lock);
+	idle.wait(lk, [this]{return tasks.empty() && running == 0;});
+}
+
+void FlushScheduler::do_work(flush_task_t on_start) {
+	if (on_start) on_start();
+	std::unique_lock<std::mutex> lk(lock);
+	while(true) {
+		work.wait(lk, [this]{return !tasks.empty() || shutdown;});
+		if (tasks.empty()) 
+			return; // shutdown and nothing left to do
+
+		flush_task_t task = std::move(tasks.front());
+		tasks.pop_front();
+		running++;
+		lk.unlock();
+
+		task();
+
+		lk.lock();
+		running--;
+		if (running == 0 && tasks.empty())
+			idle.notify_all();
+	}
+}
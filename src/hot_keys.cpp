@@ -0,0 +1,75 @@
+#include "../include/hot_keys.h"
+
+#include <algorithm>
+
+HotKeys::HotKeys(uint32_t k, uint64_t refresh) : k(k), refresh_samples(refresh), samples(0), refreshes(0) {
+	// keep the table at most a quarter full so probes stay short
+	uint32_t table_size = 4;
+	while (table_size < 4 * k) table_size *= 2;
+	set.table.assign(table_size, {0, -1});
+	set.mask = table_size - 1;
+	slot_keys.assign(k, 0);
+	slot_used.assign(k, false);
+}
+
+void HotSet::insert(Node key, int32_t slot) {
+	uint32_t i = hash(key) & mask;
+	while (table[i].slot >= 0) i = (i + 1) & mask;
+	table[i] = {key, slot};
+}
+
+void HotKeys::refresh(std::vector<std::pair<uint32_t, Node>> &evicted) {
+	// find the k most frequent keys
+	std::vector<std::pair<uint64_t, Node>> ranked;
+	ranked.reserve(counts.size());
+	uint64_t total = 0;
+	for (auto &entry : counts) {
+		ranked.push_back({entry.second, entry.first});
+		total += entry.second;
+	}
+	uint32_t num_hot = std::min<size_t>(k, ranked.size());
+	std::nth_element(ranked.begin(), ranked.begin() + num_hot, ranked.end(),
+	  [](const std::pair<uint64_t, Node> &a, const std::pair<uint64_t, Node> &b) {
+	    return a.first > b.first;
+	  });
+
+	// a key is only worth a buffer if it gets a good share of the updates
+	std::unordered_map<Node, bool> hot;
+	for (uint32_t i = 0; i < num_hot; i++) {
+		if (ranked[i].first * 4 * k >= total)
+			hot[ranked[i].second] = true;
+	}
+
+	// keys that stay hot keep their slots, the rest are freed
+	for (uint32_t s = 0; s < k; s++) {
+		if (!slot_used[s]) continue;
+		auto it = hot.find(slot_keys[s]);
+		if (it == hot.end()) {
+			evicted.push_back({s, slot_keys[s]});
+			slot_used[s] = false;
+		} else
+			hot.erase(it);
+	}
+	uint32_t s = 0;
+	for (auto &entry : hot) {
+		while (slot_used[s]) s++;
+		slot_keys[s] = entry.first;
+		slot_used[s] = true;
+	}
+
+	set.table.assign(set.table.size(), {0, -1});
+	for (s = 0; s < k; s++) {
+		if (slot_used[s]) set.insert(slot_keys[s], s);
+	}
+	refreshes++;
+
+	// decay the counts
+	for (auto it = counts.begin(); it != counts.end();) {
+		it->second /= 2;
+		if (it->second == 0)
+			it = counts.erase(it);
+		else
+			++it;
+	}
+	samples = 0;
+}
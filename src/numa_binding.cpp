@@ -0,0 +1,67 @@
+#include "../include/numa_binding.h"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * Parse a sysfs list such as "0-3,8,10-11" into its members.
+ * Returns an empty list if the file cannot be read.
+ */
+static std::vector<int> read_list(const std::string &path) {
+	std::vector<int> members;
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == nullptr) return members;
+
+	int lo, hi;
+	char sep;
+	while (fscanf(f, "%d", &lo) == 1) {
+		hi = lo;
+		sep = fgetc(f);
+		if (sep == '-') {
+			if (fscanf(f, "%d", &hi) != 1) break;
+			sep = fgetc(f);
+		}
+		for (int i = lo; i <= hi; i++) members.push_back(i);
+		if (sep != ',') break;
+	}
+	fclose(f);
+	return members;
+}
+
+int numa_node_count() {
+	std::vector<int> nodes = read_list("/sys/devices/system/node/online");
+	return nodes.empty()? 1 : nodes.back() + 1;
+}
+
+bool bind_to_numa_node(int node) {
+	std::vector<int> cpus = read_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	if (cpus.empty()) return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		return false;
+
+	// prefer rather than bind so a full node spills over instead of failing
+	if (node < 64) {
+		uint64_t mask = 1ull << node;
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 64);
+	}
+	return true;
+}
+
+void place_on_numa_node(void *mem, size_t size, int node) {
+	// prefer, as above
+	if (node < 0 || node >= 64) return;
+	uint64_t mask = 1ull << node;
+	syscall(SYS_mbind, mem, size, MPOL_PREFERRED, &mask, 64, 0);
+}
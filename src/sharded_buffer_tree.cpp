@@ -0,0 +1,166 @@
+#include "../include/sharded_buffer_tree.h"
+#include "../include/numa_binding.h"
+
+#include <algorithm>
+#include <thread>
+
+template <class Record>
+BasicShardedBufferTree<Record>::BasicShardedBufferTree(std::string dir, uint32_t size, uint32_t b,
+  Node nodes, int workers, bool reset, int num_shards, bool numa, const options_t &opts) {
+	// a shard needs a key for every child of its root, else its tree has no levels
+	Node min_keys = std::max<Node>(2, b);
+	num_shards = std::max<Node>(1, std::min<Node>(num_shards, nodes / min_keys));
+	router.init(0, nodes - 1, num_shards);
+	non_block = false;
+
+	// build the shards in parallel, each on a thread bound to its NUMA node
+	// so that the memory it touches while being set up is local
+	int numa_nodes = numa? numa_node_count() : 0;
+	int shard_workers = std::max(1, (workers + num_shards - 1) / num_shards);
+	shards.resize(num_shards);
+	std::vector<std::thread> builders;
+	for (int s = 0; s < num_shards; s++) {
+		builders.emplace_back([&, s]() {
+			options_t shard_opts = opts;
+			// leaves hold updates for sketches of the whole graph
+			shard_opts.graph_nodes = (opts.graph_nodes > 0)? opts.graph_nodes : nodes;
+			shard_opts.first_key = (s < (int) router.larger_kids)? s * router.big_width
+			  : router.larger_count + (s - router.larger_kids) * router.small_width;
+			Node keys = (s < (int) router.larger_kids)? router.big_width : router.small_width;
+			if (numa) {
+				shard_opts.numa_node = s % numa_nodes;
+				bind_to_numa_node(shard_opts.numa_node);
+			}
+			shards[s] = new tree_t(dir + "shard" + std::to_string(s) + "_", size, b, keys,
+			  shard_workers, reset, shard_opts);
+		});
+	}
+	for (std::thread &t : builders)
+		t.join();
+}
+
+template <class Record>
+BasicShardedBufferTree<Record>::~BasicShardedBufferTree() {
+	for (tree_t *shard : shards)
+		delete shard;
+}
+
+template <class Record>
+insert_ret_t BasicShardedBufferTree<Record>::insert(record_t upd) {
+	shards[shard_of(upd.first)]->insert(upd);
+}
+
+template <class Record>
+insert_ret_t BasicShardedBufferTree<Record>::insert_batch(const record_t *upds, size_t n) {
+	// partition a chunk at a time so the staging space stays small
+	const size_t chunk = 1 << 16;
+	static thread_local std::vector<std::vector<record_t>> staged;
+	staged.resize(shards.size());
+	for (size_t start = 0; start < n; start += chunk) {
+		size_t end = std::min(n, start + chunk);
+		for (size_t i = start; i < end; i++)
+			staged[shard_of(upds[i].first)].push_back(upds[i]);
+		for (uint32_t s = 0; s < shards.size(); s++) {
+			if (staged[s].empty()) continue;
+			shards[s]->insert_batch(staged[s].data(), staged[s].size());
+			staged[s].clear();
+		}
+	}
+}
+
+template <class Record>
+bool BasicShardedBufferTree<Record>::try_insert(record_t upd) {
+	return shards[shard_of(upd.first)]->try_insert(upd);
+}
+
+/*
+ * Take leaves from the shards, starting with the worker's home shard and
+ * then stealing from the others. If every shard is empty wait on the home
+ * shard for a while before looking again.
+ * take(shard, worker id in the shard, timeout_us) takes from one shard.
+ */
+template <class Record, class Take>
+static bool take_from_shards(std::vector<BasicBufferTree<Record>*> &shards, uint32_t home, int id,
+  std::atomic<bool> &non_block, int poll_us, Take take) {
+	while (true) {
+		// a leaf queued on another shard just before non_block was set is
+		// only seen by a pass which starts after it, so look once more
+		bool last_pass = non_block;
+		for (uint32_t k = 0; k < shards.size(); k++) {
+			if (take(shards[(home + k) % shards.size()], id, 0)) return true;
+		}
+		if (last_pass) return false;
+		if (take(shards[home], id, poll_us)) return true;
+	}
+}
+
+template <class Record>
+bool BasicShardedBufferTree<Record>::get_data(data_ret_t &data, int worker) {
+	return take_from_shards<Record>(shards, home_shard(worker), shard_worker(worker), non_block,
+	  steal_poll_us, [&data](tree_t *shard, int id, int64_t timeout_us) {
+	    return shard->get_data(data, id, timeout_us);
+	  });
+}
+
+template <class Record>
+bool BasicShardedBufferTree<Record>::get_data_batch(std::vector<data_ret_t> &data, size_t max_leaves,
+  uint64_t max_bytes, int worker) {
+	return take_from_shards<Record>(shards, home_shard(worker), shard_worker(worker), non_block,
+	  steal_poll_us, [&](tree_t *shard, int id, int64_t timeout_us) {
+	    return shard->get_data_batch(data, max_leaves, max_bytes, id, timeout_us);
+	  });
+}
+
+template <class Record>
+bool BasicShardedBufferTree<Record>::lease_data(lease_t &lease, int worker) {
+	return take_from_shards<Record>(shards, home_shard(worker), shard_worker(worker), non_block,
+	  steal_poll_us, [&lease](tree_t *shard, int id, int64_t timeout_us) {
+	    return shard->lease_data(lease, id, timeout_us);
+	  });
+}
+
+template <class Record>
+void BasicShardedBufferTree<Record>::release_data(lease_t &lease) {
+	// the keys of a shard's leaves are never rebased, so the key finds the shard
+	shards[shard_of(lease.key)]->release_data(lease);
+}
+
+template <class Record>
+flush_ret_t BasicShardedBufferTree<Record>::force_flush() {
+	std::vector<std::thread> flushers;
+	for (tree_t *shard : shards)
+		flushers.emplace_back([shard]() {shard->force_flush();});
+	for (std::thread &t : flushers)
+		t.join();
+}
+
+template <class Record>
+void BasicShardedBufferTree<Record>::set_non_block(bool block) {
+	non_block = block;
+	for (tree_t *shard : shards)
+		shard->set_non_block(block);
+}
+
+template <class Record>
+queue_stats_t BasicShardedBufferTree<Record>::get_queue_stats() {
+	queue_stats_t total = {0, 0, 0, 0, 0};
+	for (tree_t *shard : shards) {
+		queue_stats_t stats = shard->get_queue_stats();
+		total.producer_blocked_ns += stats.producer_blocked_ns;
+		total.producer_blocks     += stats.producer_blocks;
+		total.depth_bytes         += stats.depth_bytes;
+		total.grows               += stats.grows;
+		total.shrinks             += stats.shrinks;
+	}
+	return total;
+}
+
+template <class Record>
+void BasicShardedBufferTree<Record>::set_flush_kernel(flush_kernel_t kernel) {
+	for (tree_t *shard : shards)
+		shard->set_flush_kernel(kernel);
+}
+
+template class BasicShardedBufferTree<NodeRecord>;
+template class BasicShardedBufferTree<Node32Record>;
+template class BasicShardedBufferTree<WeightedRecord>;
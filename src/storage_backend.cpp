@@ -0,0 +1,289 @@
+#include "../include/storage_backend.h"
+#include "../include/flush_scheduler.h"
+
+#include <unistd.h>
+#include <fcntl.h>  //posix_fallocate
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <condition_variable>
+#include <mutex>
+
+/*
+ * Page aligned memory used to widen unaligned O_DIRECT requests.
+ * Each thread has its own and it grows to fit the largest request.
+ */
+struct BounceBuffer {
+	char *data = nullptr;
+	size_t size = 0;
+
+	char *get(size_t len, size_t align) {
+		if (len > size) {
+			free(data);
+			if (posix_memalign((void **) &data, align, len) != 0) {
+				printf("ERROR: failed to allocate %lu byte bounce buffer\n", len);
+				exit(EXIT_FAILURE);
+			}
+			size = len;
+		}
+		return data;
+	}
+	~BounceBuffer() {free(data);}
+};
+static thread_local BounceBuffer bounce;
+
+FileBackend::FileBackend(std::string file_name, int flags) {
+	// create the file if it does not already exist
+	printf("opening file %s\n", file_name.c_str());
+	fd = open(file_name.c_str(), flags | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1 && errno == EINVAL && (flags & O_DIRECT)) {
+		printf("WARNING: file system does not support O_DIRECT. Using the page cache.\n");
+		flags &= ~O_DIRECT;
+		fd = open(file_name.c_str(), flags | O_CREAT, S_IRUSR | S_IWUSR);
+	}
+	direct = flags & O_DIRECT;
+	align  = sysconf(_SC_PAGE_SIZE);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open backing storage file! error=%s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+FileBackend::~FileBackend() {
+	close(fd);
+}
+
+void FileBackend::write(const char *data, uint32_t size, File_Pointer offset) {
+	if (!direct) {
+		write_all(data, size, offset);
+		return;
+	}
+
+	uint32_t head = offset % align;
+	uint32_t body = (head == 0 && (uintptr_t) data % align == 0)? size - size % align : 0;
+	if (body > 0) // aligned pages are written straight from the caller's memory
+		write_all(data, body, offset);
+	if (body == size) return;
+
+	// widen the rest to whole pages, keeping what precedes it in its first page
+	File_Pointer start = offset + body - head;
+	uint32_t len       = head + size - body;
+	uint32_t padded    = len + (align - len % align) % align;
+	char *buf          = bounce.get(padded, align);
+	if (head > 0)
+		read_all(buf, align, start);
+	memcpy(buf + head, data + body, size - body);
+	memset(buf + len, 0, padded - len);
+	write_all(buf, padded, start);
+}
+
+void FileBackend::read(char *data, uint32_t size, File_Pointer offset) {
+	if (!direct) {
+		read_all(data, size, offset);
+		return;
+	}
+
+	uint32_t head = offset % align;
+	uint32_t body = (head == 0 && (uintptr_t) data % align == 0)? size - size % align : 0;
+	if (body > 0) // aligned pages are read straight into the caller's memory
+		read_all(data, body, offset);
+	if (body == size) return;
+
+	// read the partial pages at either end into the bounce buffer
+	File_Pointer start = offset + body - head;
+	uint32_t len       = head + size - body;
+	uint32_t padded    = len + (align - len % align) % align;
+	char *buf          = bounce.get(padded, align);
+	read_all(buf, padded, start);
+	memcpy(data + body, buf + head, size - body);
+}
+
+void FileBackend::write_all(const char *data, uint32_t size, File_Pointer offset) {
+	uint32_t w = 0;
+	while(w < size) {
+		int len = pwrite(fd, data + w, size - w, offset + w);
+		if (len == -1) {
+			printf("ERROR: write to backing store at %lu failed %s\n", offset, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		w += len;
+	}
+}
+
+void FileBackend::read_all(char *data, uint32_t size, File_Pointer offset) {
+	uint32_t r = 0;
+	while(r < size) {
+		int len = pread(fd, data + r, size - r, offset + r);
+		if (len == -1) {
+			printf("ERROR: read from backing store at %lu failed %s\n", offset, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (len == 0)
+			break; // end of file
+		r += len;
+	}
+}
+
+void FileBackend::allocate(File_Pointer size) {
+	// allocate file space for all the nodes to prevent fragmentation
+	#ifdef HAVE_FALLOCATE
+	fallocate(fd, 0, 0, size); // linux only but fast
+	#else
+	posix_fallocate(fd, 0, size); // portable but much slower
+	#endif
+}
+
+MmapBackend::MmapBackend(std::string file_name, int flags) 
+  : FileBackend(file_name, flags & ~O_DIRECT), map(nullptr), map_len(0) {}
+
+MmapBackend::~MmapBackend() {
+	if (map != nullptr)
+		munmap(map, map_len);
+}
+
+void MmapBackend::write(const char *data, uint32_t size, File_Pointer offset) {
+	memcpy(map + offset, data, size);
+}
+
+void MmapBackend::read(char *data, uint32_t size, File_Pointer offset) {
+	memcpy(data, map + offset, size);
+}
+
+void MmapBackend::allocate(File_Pointer size) {
+	// the file must be at least as large as the mapping
+	FileBackend::allocate(size);
+	if (ftruncate(fd, size) == -1) {
+		printf("ERROR: failed to size backing store to %lu bytes %s\n", size, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		printf("ERROR: failed to map backing store %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	map     = (char *) mem;
+	map_len = size;
+}
+
+void MmapBackend::advise(File_Pointer offset, File_Pointer size, access_hint_t hint) {
+	int advice = MADV_NORMAL;
+	if (hint == ACCESS_HOT)        advice = MADV_WILLNEED;
+	if (hint == ACCESS_SEQUENTIAL) advice = MADV_SEQUENTIAL;
+	if (hint == ACCESS_RANDOM)     advice = MADV_RANDOM;
+	// a hint that can't be followed is not an error
+	madvise(map + offset, size, advice);
+}
+
+MemoryBackend::~MemoryBackend() {
+	free(arena);
+}
+
+void MemoryBackend::write(const char *data, uint32_t size, File_Pointer offset) {
+	memcpy(arena + offset, data, size);
+}
+
+void MemoryBackend::read(char *data, uint32_t size, File_Pointer offset) {
+	memcpy(data, arena + offset, size);
+}
+
+void MemoryBackend::allocate(File_Pointer size) {
+	// pages are only backed by memory once they are written to
+	arena = (char *) calloc(size, sizeof(char));
+	if (arena == nullptr) {
+		printf("ERROR: failed to allocate %lu bytes for the in memory backing store\n", size);
+		exit(EXIT_FAILURE);
+	}
+}
+
+StripedBackend::StripedBackend(std::vector<StorageBackend*> devices) : devices(devices) {
+	starts.assign(devices.size(), 0);
+	if (devices.size() > 1) {
+		for (size_t d = 0; d < devices.size(); d++)
+			io_queues.push_back(new FlushScheduler(1));
+	}
+}
+
+StripedBackend::~StripedBackend() {
+	for (FlushScheduler *queue : io_queues)
+		delete queue;
+	for (StorageBackend *device : devices)
+		delete device;
+}
+
+void StripedBackend::set_regions(const std::vector<File_Pointer> &region_starts) {
+	starts = region_starts;
+}
+
+void StripedBackend::write(const char *data, uint32_t size, File_Pointer offset) {
+	size_t d = device_of(offset);
+	devices[d]->write(data, size, offset - starts[d]);
+}
+
+void StripedBackend::read(char *data, uint32_t size, File_Pointer offset) {
+	size_t d = device_of(offset);
+	devices[d]->read(data, size, offset - starts[d]);
+}
+
+bool StripedBackend::batches_writes() {
+	if (devices.size() > 1) return true; // the devices are written in parallel
+	return devices[0]->batches_writes();
+}
+
+void StripedBackend::write_batch(write_req_t *reqs, size_t num) {
+	// gather the writes of each device, relative to the device
+	static thread_local std::vector<std::vector<write_req_t>> by_device;
+	std::vector<std::vector<write_req_t>> *groups = &by_device;
+	groups->resize(devices.size());
+	for (size_t i = 0; i < num; i++) {
+		size_t d = device_of(reqs[i].offset);
+		(*groups)[d].push_back({reqs[i].data, reqs[i].size, reqs[i].offset - starts[d]});
+	}
+
+	// every device but the first is written by its I/O thread and the first
+	// by us, so the batch takes as long as its largest share
+	std::mutex lock;
+	std::condition_variable done;
+	size_t pending = 0;
+	size_t own = devices.size();
+	for (size_t d = 0; d < devices.size(); d++) {
+		if ((*groups)[d].empty()) continue;
+		if (own == devices.size()) {
+			own = d;
+			continue;
+		}
+		pending++;
+		io_queues[d]->submit([&, groups, d]() {
+			devices[d]->write_batch((*groups)[d].data(), (*groups)[d].size());
+			std::lock_guard<std::mutex> lk(lock);
+			if (--pending == 0) done.notify_one();
+		});
+	}
+	if (own < devices.size())
+		devices[own]->write_batch((*groups)[own].data(), (*groups)[own].size());
+
+	std::unique_lock<std::mutex> lk(lock);
+	done.wait(lk, [&pending]{return pending == 0;});
+	lk.unlock();
+	for (std::vector<write_req_t> &group : *groups)
+		group.clear();
+}
+
+void StripedBackend::allocate(File_Pointer size) {
+	for (size_t d = 0; d < devices.size(); d++) {
+		File_Pointer end = (d + 1 < devices.size())? starts[d + 1] : size;
+		devices[d]->allocate(end - starts[d]);
+	}
+}
+
+void StripedBackend::advise(File_Pointer offset, File_Pointer size, access_hint_t hint) {
+	// split the region at the boundaries of the devices
+	while (size > 0) {
+		size_t d = device_of(offset);
+		File_Pointer end = (d + 1 < devices.size())? starts[d + 1] : offset + size;
+		File_Pointer len = (end - offset < size)? end - offset : size;
+		devices[d]->advise(offset - starts[d], len, hint);
+		offset += len;
+		size   -= len;
+	}
+}
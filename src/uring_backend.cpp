@@ -0,0 +1,186 @@
+#include "../include/uring_backend.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+static inline int io_uring_setup(unsigned entries, io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+UringBackend::UringBackend(std::string file_name, int flags) : FileBackend(file_name, flags) {}
+
+UringBackend::~UringBackend() {
+	for (Ring *ring : free_rings) {
+		destroy_ring(ring);
+	}
+}
+
+bool UringBackend::available() {
+	Ring *ring = create_ring(2);
+	if (ring == nullptr)
+		return false;
+	destroy_ring(ring);
+	return true;
+}
+
+UringBackend::Ring *UringBackend::create_ring(unsigned entries) {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = io_uring_setup(entries, &p);
+	if (fd < 0)
+		return nullptr;
+
+	Ring *ring       = new Ring();
+	ring->fd         = fd;
+	ring->entries    = p.sq_entries;
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	ring->sqes_len   = p.sq_entries * sizeof(io_uring_sqe);
+	bool single_map  = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_map) {
+		ring->sq_map_len = std::max(ring->sq_map_len, ring->cq_map_len);
+		ring->cq_map_len = ring->sq_map_len;
+	}
+
+	ring->sq_map = mmap(nullptr, ring->sq_map_len, PROT_READ | PROT_WRITE, 
+	  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_map = single_map? ring->sq_map : mmap(nullptr, ring->cq_map_len, 
+	  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes   = (io_uring_sqe *) mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE, 
+	  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		close(fd);
+		delete ring;
+		return nullptr;
+	}
+
+	char *sq = (char *) ring->sq_map;
+	char *cq = (char *) ring->cq_map;
+	ring->sq_head  = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head  = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes     = (io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->iovecs   = new iovec[ring->entries];
+	return ring;
+}
+
+void UringBackend::destroy_ring(Ring *ring) {
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	munmap(ring->sq_map, ring->sq_map_len);
+	close(ring->fd);
+	delete[] ring->iovecs;
+	delete ring;
+}
+
+UringBackend::Ring *UringBackend::checkout_ring() {
+	{
+		std::lock_guard<std::mutex> lk(ring_lock);
+		if (!free_rings.empty()) {
+			Ring *ring = free_rings.back();
+			free_rings.pop_back();
+			return ring;
+		}
+	}
+	Ring *ring = create_ring(ring_entries);
+	if (ring == nullptr) {
+		printf("ERROR: failed to create io_uring %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return ring;
+}
+
+void UringBackend::return_ring(Ring *ring) {
+	std::lock_guard<std::mutex> lk(ring_lock);
+	free_rings.push_back(ring);
+}
+
+void UringBackend::write_batch(write_req_t *reqs, size_t num) {
+	if (direct) {
+		StorageBackend::write_batch(reqs, num);
+		return;
+	}
+	Ring *ring = checkout_ring();
+	while (num > 0) {
+		size_t n = (num < ring->entries)? num : ring->entries;
+		submit_and_wait(ring, reqs, n);
+		reqs += n;
+		num  -= n;
+	}
+	return_ring(ring);
+}
+
+void UringBackend::submit_and_wait(Ring *ring, write_req_t *reqs, size_t num) {
+	// queue a write for every request. We are the only submitter to this ring
+	// so only the kernel's view of the tail needs to be ordered
+	unsigned tail = *ring->sq_tail;
+	for (size_t i = 0; i < num; i++) {
+		unsigned idx      = tail & *ring->sq_mask;
+		io_uring_sqe *sqe = &ring->sqes[idx];
+		ring->iovecs[i].iov_base = (void *) reqs[i].data;
+		ring->iovecs[i].iov_len  = reqs[i].size;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = IORING_OP_WRITEV; // rather than WRITE to support older kernels
+		sqe->fd        = fd;
+		sqe->addr      = (uint64_t) &ring->iovecs[i];
+		sqe->len       = 1;
+		sqe->off       = reqs[i].offset;
+		sqe->user_data = i;
+		ring->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	// submit the whole batch
+	size_t submitted = 0;
+	while (submitted < num) {
+		int ret = io_uring_enter(ring->fd, num - submitted, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			printf("ERROR: io_uring_enter failed %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		submitted += ret;
+	}
+
+	// and reap completions as they arrive. The caller holds the children's
+	// locks until we return, so every write must be complete by then
+	size_t completed = 0;
+	while (true) {
+		unsigned head   = *ring->cq_head;
+		unsigned c_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != c_tail; head++, completed++) {
+			io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			write_req_t &req  = reqs[cqe->user_data];
+			if (cqe->res < 0) {
+				printf("ERROR: write to backing store at %lu failed %s\n", req.offset, strerror(-cqe->res));
+				exit(EXIT_FAILURE);
+			}
+			if ((uint32_t) cqe->res < req.size) // finish short writes synchronously
+				FileBackend::write(req.data + cqe->res, req.size - cqe->res, req.offset + cqe->res);
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		if (completed == num)
+			break;
+
+		if (io_uring_enter(ring->fd, 0, num - completed, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			printf("ERROR: io_uring_enter failed %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
@@ -2,7 +2,10 @@
 #include <math.h>
 #include <thread>
 #include <atomic>
+#include <algorithm>
+#include <sys/stat.h>
 #include "../include/buffer_tree.h"
+#include "../include/sharded_buffer_tree.h"
 
 #define KB (1 << 10)
 #define MB (1 << 20)
@@ -33,16 +36,59 @@ void querier(BufferTree *buf_tree, int nodes) {
   }
 }
 
+// the same as querier but leases the data rather than copying it out
+void lease_querier(BufferTree *buf_tree, int nodes) {
+  LeafLease lease;
+  while(true) {
+    bool valid = buf_tree->lease_data(lease);
+    if (valid) {
+      for (Node upd : lease) {
+        ASSERT_EQ(nodes - (lease.key + 1), upd) << "key " << lease.key;
+        upd_processed += 1;
+      }
+      buf_tree->release_data(lease);
+    }
+    else if(shutdown)
+      return;
+  }
+}
+
+// the same as querier but takes many leaves at a time
+void batch_querier(BufferTree *buf_tree, int nodes) {
+  std::vector<data_ret_t> data;
+  while(true) {
+    bool valid = buf_tree->get_data_batch(data, 8, 64 * KB);
+    if (valid) {
+      for (data_ret_t &leaf : data) {
+        for (Node upd : leaf.second) {
+          ASSERT_EQ(nodes - (leaf.first + 1), upd) << "key " << leaf.first;
+          upd_processed += 1;
+        }
+      }
+    }
+    else if(shutdown)
+      return;
+  }
+}
+
 // helper function to run a basic test of the buffer tree with
 // various parameters
 // this test only works if the depth of the tree does not exceed 1
 // and no work is claimed off of the work queue
 // to work correctly num_updates must be a multiple of nodes
-void run_test(const int nodes, const int num_updates, const int buffer_size, const int branch_factor) {
-  printf("Running Test: nodes=%i num_updates=%i buffer_size %i branch_factor %i\n",
-         nodes, num_updates, buffer_size, branch_factor);
+void run_test(const int nodes, const int num_updates, const int buffer_size, const int branch_factor,
+ const int flush_workers=0, const flush_kernel_t kernel=SCATTER_KERNEL, const storage_t storage=FILE_STORAGE,
+ const bool direct_io=false, const bool compact=false) {
+  printf("Running Test: nodes=%i num_updates=%i buffer_size %i branch_factor %i flush_workers %i\n",
+         nodes, num_updates, buffer_size, branch_factor, flush_workers);
 
-  BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, 1, true);
+  BufferTreeOptions opts;
+  opts.flush_workers = flush_workers;
+  opts.storage       = storage;
+  opts.direct_io     = direct_io;
+  opts.compact       = compact;
+  BufferTree *buf_tree = new BufferTree("./test_", buffer_size, branch_factor, nodes, 1, true, opts);
+  buf_tree->set_flush_kernel(kernel);
   shutdown = false;
   upd_processed = 0;
   std::thread qworker(querier, buf_tree, nodes);
@@ -143,6 +189,221 @@ TEST(BasicInsert, EvilInsertions) {
 }
 
 
+TEST(AsyncFlush, Medium) {
+  const int nodes = 100;
+  const int num_updates = 360000;
+  const int buf = MB;
+  const int branch = 8;
+
+  run_test(nodes, num_updates, buf, branch, 2);
+}
+
+TEST(AsyncFlush, FillLowest) {
+  uint updates = (8 * MB) / BufferTree::serial_update_size;
+  updates -= updates % 8 + 8;
+
+  const int nodes = 8;
+  const int num_updates = updates;
+  const int buf = MB;
+  const int branch = 2;
+
+  run_test(nodes, num_updates, buf, branch, 4);
+}
+
+TEST(FlushKernel, RadixMedium) {
+  const int nodes = 100;
+  const int num_updates = 360000;
+  const int buf = MB;
+  const int branch = 8;
+
+  run_test(nodes, num_updates, buf, branch, 0, RADIX_KERNEL);
+}
+
+TEST(FlushKernel, RadixSmallAsync) {
+  const int nodes = 10;
+  const int num_updates = 40000;
+  const int buf = KB << 2;
+  const int branch = 2;
+
+  run_test(nodes, num_updates, buf, branch, 2, RADIX_KERNEL);
+}
+
+// insert and check every update with the given querier in 4 threads
+void run_query_test(void (*query_fn)(BufferTree *, int)) {
+  const int nodes = 1024;
+  const int num_updates = 1024 * 256;
+  const int buf = KB << 3;
+  const int branch = 8;
+
+  for (storage_t storage : {FILE_STORAGE, MEMORY_STORAGE}) {
+    BufferTreeOptions opts;
+    opts.storage = storage;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 4, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+    std::thread qworkers[4];
+    for (int t = 0; t < 4; t++)
+      qworkers[t] = std::thread(query_fn, buf_tree, nodes);
+
+    for (int i = 0; i < num_updates; i++)
+      buf_tree->insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)});
+    buf_tree->force_flush();
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    for (int t = 0; t < 4; t++)
+      qworkers[t].join();
+    ASSERT_EQ(num_updates, upd_processed);
+    delete buf_tree;
+  }
+}
+
+TEST(GetData, Leases) {
+  run_query_test(lease_querier);
+}
+
+TEST(GetData, Batches) {
+  run_query_test(batch_querier);
+}
+
+// each consumer owns a queue and a range of keys but may steal from others
+TEST(GetData, KeyAffinity) {
+  const int nodes = 1024;
+  const int num_updates = 1024 * 256;
+  const int buf = KB << 3;
+  const int branch = 8;
+  const int workers = 4;
+
+  for (storage_t storage : {FILE_STORAGE, MEMORY_STORAGE}) {
+    BufferTreeOptions opts;
+    opts.storage = storage;
+    opts.consumer_queues = workers;
+    BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, workers, true, opts);
+    shutdown = false;
+    upd_processed = 0;
+    std::atomic<uint32_t> owned(0);
+    std::thread qworkers[workers];
+    for (int w = 0; w < workers; w++) {
+      qworkers[w] = std::thread([&, w]() {
+        data_ret_t data;
+        while(true) {
+          if (buf_tree->get_data(data, w)) {
+            if (data.first * workers / nodes == (Node) w) owned += 1;
+            for (Node upd : data.second) {
+              ASSERT_EQ(nodes - (data.first + 1), upd) << "key " << data.first;
+              upd_processed += 1;
+            }
+          }
+          else if(shutdown)
+            return;
+        }
+      });
+    }
+
+    for (int i = 0; i < num_updates; i++)
+      buf_tree->insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)});
+    buf_tree->force_flush();
+    shutdown = true;
+    buf_tree->set_non_block(true);
+    for (int w = 0; w < workers; w++)
+      qworkers[w].join();
+    ASSERT_EQ(num_updates, upd_processed);
+    ASSERT_GT(owned, 0);
+    delete buf_tree;
+  }
+}
+
+// falls back to pread/pwrite if io_uring is not available
+TEST(StorageBackend, UringFillLowest) {
+  const int nodes = 4096;
+  const int num_updates = 2 * 4096 * 64;
+  const int buf = KB << 3;
+  const int branch = 16;
+
+  run_test(nodes, num_updates, buf, branch, 0, SCATTER_KERNEL, URING_STORAGE);
+  run_test(nodes, num_updates, buf, branch, 2, RADIX_KERNEL, URING_STORAGE);
+}
+
+// buffer sizes which are not a multiple of the page size exercise the
+// partial page handling of O_DIRECT
+TEST(StorageBackend, DirectIO) {
+  const int nodes = 1000;
+  const int num_updates = 1000 * 300;
+  const int buf = (KB << 3) + 48;
+  const int branch = 8;
+
+  run_test(nodes, num_updates, buf, branch, 0, SCATTER_KERNEL, FILE_STORAGE, true);
+  run_test(nodes, num_updates, buf, branch, 2, RADIX_KERNEL, URING_STORAGE, true);
+}
+
+TEST(StorageBackend, InMemory) {
+  const int nodes = 4096;
+  const int num_updates = 4096 * 128;
+  const int buf = KB << 3;
+  const int branch = 16;
+
+  run_test(nodes, num_updates, buf, branch, 0, SCATTER_KERNEL, MEMORY_STORAGE);
+  run_test(nodes, num_updates, buf, branch, 2, RADIX_KERNEL, MEMORY_STORAGE);
+}
+
+TEST(StorageBackend, Mmap) {
+  const int nodes = 4096;
+  const int num_updates = 4096 * 128;
+  const int buf = KB << 3;
+  const int branch = 16;
+
+  run_test(nodes, num_updates, buf, branch, 0, SCATTER_KERNEL, MMAP_STORAGE);
+  run_test(nodes, num_updates, buf, branch, 2, RADIX_KERNEL, MMAP_STORAGE);
+}
+
+TEST(StorageBackend, Compact) {
+  const int nodes = 1024;
+  const int num_updates = 400000;
+  run_test(nodes, num_updates, KB << 3, 4, 0, SCATTER_KERNEL, FILE_STORAGE, false, true);
+  run_test(nodes, num_updates, KB << 3, 4, 2, RADIX_KERNEL, FILE_STORAGE, false, true);
+  run_test(nodes, num_updates, KB << 3, 4, 0, SCATTER_KERNEL, URING_STORAGE, false, true);
+  run_test(nodes, num_updates, KB << 3, 4, 2, SCATTER_KERNEL, MEMORY_STORAGE, false, true);
+  run_test(nodes, num_updates, KB << 3, 4, 0, RADIX_KERNEL, FILE_STORAGE, true, true);
+}
+
+// a backing store striped across three directories, of which only two
+// hold level 1 subtrees when the branching factor is two
+void run_striped_test(const int branch, const int flush_workers, const storage_t storage,
+ const flush_kernel_t kernel) {
+  const int nodes = 1024;
+  const int num_updates = 400000;
+  std::vector<std::string> dirs = {"./test_s0_", "./test_s1_", "./test_s2_"};
+  BufferTreeOptions opts;
+  opts.flush_workers = flush_workers;
+  opts.storage       = storage;
+  BufferTree *buf_tree = new BufferTree(dirs, KB << 3, branch, nodes, 1, true, opts);
+  buf_tree->set_flush_kernel(kernel);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker(querier, buf_tree, nodes);
+
+  for (int i = 0; i < num_updates; i++)
+    buf_tree->insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)});
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+
+  for (int d = 0; storage != MEMORY_STORAGE && d < std::min(branch, 3); d++) {
+    struct stat st;
+    ASSERT_EQ(0, stat((dirs[d] + "buffer_tree_v0.2.data").c_str(), &st));
+    ASSERT_GT(st.st_size, 0) << "directory " << d;
+  }
+}
+
+TEST(StorageBackend, Striped) {
+  run_striped_test(4, 0, FILE_STORAGE, SCATTER_KERNEL);
+  run_striped_test(4, 2, URING_STORAGE, RADIX_KERNEL);
+  run_striped_test(2, 2, FILE_STORAGE, SCATTER_KERNEL);
+  run_striped_test(8, 2, MEMORY_STORAGE, SCATTER_KERNEL); // not striped
+}
+
 TEST(Parallelism, ManyQueryThreads) {
   const int nodes = 1024;
   const int num_updates = 5206;
@@ -175,3 +436,826 @@ TEST(Parallelism, ManyQueryThreads) {
   ASSERT_EQ(num_updates, upd_processed);
   delete buf_tree;
 }
+
+// insert from many producer threads at once, each into its own root shard
+void run_parallel_test(const int producers, const int flush_workers) {
+  const int nodes = 1024;
+  const int num_updates = 400000;
+  const int buf = MB;
+  const int branch = 8;
+
+  BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 4, true, flush_workers);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread query_threads[4];
+  for (int t = 0; t < 4; t++) {
+    query_threads[t] = std::thread(querier, buf_tree, nodes);
+  }
+
+  // each producer inserts its own slice of the updates
+  std::vector<std::thread> producer_threads;
+  for (int p = 0; p < producers; p++) {
+    producer_threads.emplace_back([buf_tree, p, producers]() {
+      for (int i = p; i < num_updates; i += producers) {
+        update_t upd;
+        upd.first = i % nodes;
+        upd.second = (nodes - 1) - (i % nodes);
+        buf_tree->insert(upd);
+      }
+    });
+  }
+  for (std::thread &t : producer_threads) {
+    t.join();
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true); // switch to non-blocking calls in an effort to exit
+
+  for (int t = 0; t < 4; t++) {
+    query_threads[t].join();
+  }
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(Parallelism, ManyInsertThreads) {
+  run_parallel_test(8, 0);
+}
+
+// many flush workers flushing buffers at the same levels of the tree at once
+TEST(Parallelism, ManyFlushThreads) {
+  run_parallel_test(8, 8);
+}
+
+// insert blocks of updates of varying sizes, some of them larger than
+// the root so that they are partitioned directly into level 1
+TEST(BatchInsert, MixedBatchSizes) {
+  const int nodes = 100;
+  const int buf = KB << 4;
+  const int branch = 8;
+  const int batch_sizes[] = {1, 7, 100, 1000, 5000};
+
+  BufferTree *buf_tree = new BufferTree("./test_", buf, branch, nodes, 1, true);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker(querier, buf_tree, nodes);
+
+  int num_updates = 0;
+  std::vector<update_t> batch;
+  for (int r = 0; r < 10; r++) {
+    for (int size : batch_sizes) {
+      batch.clear();
+      for (int i = 0; i < size; i++, num_updates++) {
+        Node src = num_updates % nodes;
+        batch.push_back({src, (nodes - 1) - src});
+      }
+      buf_tree->insert_batch(batch.data(), batch.size());
+    }
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true); // switch to non-blocking calls in an effort to exit
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+// half of the updates go to a handful of keys, which should become hot.
+// Sets written to the bytes written below the root
+void run_hot_key_test(const int flush_workers, const storage_t storage, const int hot_keys=8,
+ uint64_t *written=nullptr) {
+  const int nodes = 1024;
+  const int num_updates = 400000;
+  BufferTreeOptions opts;
+  opts.flush_workers = flush_workers;
+  opts.storage       = storage;
+  opts.hot_keys      = hot_keys;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 5, 8, nodes, 1, true, opts);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker(querier, buf_tree, nodes);
+
+  for (int i = 0; i < num_updates; i++) {
+    update_t upd;
+    upd.first = (i % 2 == 0)? (i / 2) % 4 : i % nodes;
+    upd.second = (nodes - 1) - upd.first;
+    buf_tree->insert(upd);
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  if (written != nullptr) *written = buf_tree->get_bytes_written();
+  delete buf_tree;
+}
+
+TEST(HotKeys, SkewedInserts) {
+  run_hot_key_test(0, FILE_STORAGE);
+  run_hot_key_test(2, FILE_STORAGE);
+  run_hot_key_test(0, MEMORY_STORAGE);
+}
+
+// the updates of hot keys are never written to the levels below the root
+TEST(HotKeys, SkipLevels) {
+  for (int flush_workers : {0, 2}) {
+    uint64_t cold_written = 0;
+    uint64_t hot_written = 0;
+    run_hot_key_test(flush_workers, FILE_STORAGE, 0, &cold_written);
+    run_hot_key_test(flush_workers, FILE_STORAGE, 8, &hot_written);
+    printf("written below the root: %lu without hot keys, %lu with\n", cold_written, hot_written);
+    ASSERT_GT(hot_written, 0u);
+    // half of the updates are to hot keys
+    ASSERT_LT(hot_written, cold_written * 6 / 10);
+  }
+}
+
+// with sort_leaves every leaf must reach the consumer sorted by destination
+void run_sorted_test(const storage_t storage, const int flush_workers) {
+  const int nodes = 1024;
+  const int num_updates = 400000;
+  BufferTreeOptions opts;
+  opts.storage       = storage;
+  opts.flush_workers = flush_workers;
+  opts.sort_leaves   = true;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 5, 8, nodes, 1, true, opts);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker([&]() {
+    LeafLease lease;
+    while(true) {
+      if (buf_tree->lease_data(lease)) {
+        Node prev = 0;
+        for (Node dst : lease) {
+          ASSERT_LE(prev, dst) << "key " << lease.key;
+          prev = dst;
+          upd_processed += 1;
+        }
+        buf_tree->release_data(lease);
+      }
+      else if(shutdown)
+        return;
+    }
+  });
+
+  uint64_t seed = 7;
+  for (int i = 0; i < num_updates; i++) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    buf_tree->insert({i % nodes, 1 + (seed >> 24) % ((Node) 1 << 36)});
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(GetData, SortedLeaves) {
+  run_sorted_test(FILE_STORAGE, 0);
+  run_sorted_test(MEMORY_STORAGE, 2);
+}
+
+// (0, 0) is an update like any other. Sorted to the front of node 0's leaf
+// it must not cut the leaf short whether the leaf is copied or leased
+void run_zero_update_test(const bool lease) {
+  const int nodes = 16;
+  const int num_updates = 40000;
+  BufferTreeOptions opts;
+  opts.sort_leaves = true;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 4, 4, nodes, 1, true, opts);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker([&]() {
+    LeafLease leaf;
+    data_ret_t data;
+    while(true) {
+      if (lease && buf_tree->lease_data(leaf)) {
+        upd_processed += leaf.count();
+        buf_tree->release_data(leaf);
+      }
+      else if (!lease && buf_tree->get_data(data))
+        upd_processed += data.second.size();
+      else if(shutdown)
+        return;
+    }
+  });
+
+  for (int i = 0; i < num_updates; i++)
+    buf_tree->insert({(Node) (i / 4) % nodes, (Node) i % 4});
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(GetData, ZeroUpdate) {
+  run_zero_update_test(false);
+  run_zero_update_test(true);
+}
+
+// every pair is inserted an odd or even number of times. Once combined the
+// parity of each pair seen by the consumer must match what was inserted
+void run_combine_test(const combine_t combine, const storage_t storage, const reducer_t reducer=nullptr) {
+  const int nodes = 256;
+  const int num_updates = 200000;
+  BufferTreeOptions opts;
+  opts.storage = storage;
+  opts.combine = combine;
+  opts.reducer = reducer;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 4, 4, nodes, 1, true, opts);
+
+  std::vector<int> inserted(nodes * 4, 0);
+  std::vector<int> seen(nodes * 4, 0);
+  std::atomic<uint64_t> delivered(0);
+  shutdown = false;
+  std::thread qworker([&]() {
+    data_ret_t data;
+    while(true) {
+      if (buf_tree->get_data(data)) {
+        for (Node dst : data.second) {
+          ASSERT_LE(dst, (Node) 4);
+          seen[data.first * 4 + dst - 1]++;
+        }
+        delivered += data.second.size();
+      }
+      else if(shutdown)
+        return;
+    }
+  });
+
+  uint64_t seed = 1;
+  for (int i = 0; i < num_updates; i++) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    Node src = (seed >> 33) % nodes;
+    Node dst = (seed >> 20) % 4;
+    inserted[src * 4 + dst]++;
+    buf_tree->insert({src, dst + 1});
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+
+  ASSERT_LT(delivered, (uint64_t) num_updates);
+  for (size_t p = 0; p < inserted.size(); p++) {
+    if (reducer) ASSERT_EQ(inserted[p] > 0, seen[p] > 0) << "pair " << p;
+    else ASSERT_EQ(inserted[p] % 2, seen[p] % 2) << "pair " << p;
+  }
+  delete buf_tree;
+}
+
+TEST(Combine, CancelPairs) {
+  run_combine_test(COMBINE_LEAVES, FILE_STORAGE);
+  run_combine_test(COMBINE_BUFFERS, FILE_STORAGE);
+  run_combine_test(COMBINE_BUFFERS, MEMORY_STORAGE);
+}
+
+// every update is inserted and then deleted, so most leaves cancel out
+// entirely. Those must never reach the consumers, not even as empty leaves
+void run_churn_test(const storage_t storage) {
+  const int nodes = 64;
+  const int num_updates = 200000;
+  BufferTreeOptions opts;
+  opts.storage = storage;
+  opts.combine = COMBINE_LEAVES;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 4, 4, nodes, 1, true, opts);
+
+  std::vector<int> seen(nodes * 4, 0);
+  shutdown = false;
+  std::thread qworker([&]() {
+    std::vector<data_ret_t> data;
+    while(true) {
+      if (buf_tree->get_data_batch(data, 8, 64 * KB)) {
+        for (data_ret_t &leaf : data) {
+          ASSERT_NE(leaf.first, (Node) 0); // key 0 is never inserted
+          ASSERT_GT(leaf.second.size(), (size_t) 0) << "key " << leaf.first;
+          for (Node dst : leaf.second)
+            seen[leaf.first * 4 + dst - 1]++;
+        }
+      }
+      else if(shutdown)
+        return;
+    }
+  });
+
+  uint64_t seed = 3;
+  for (int i = 0; i < num_updates; i++) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    Node src = 1 + (seed >> 33) % (nodes - 1);
+    Node dst = 1 + (seed >> 20) % 4;
+    buf_tree->insert({src, dst});
+    buf_tree->insert({src, dst});
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+
+  for (size_t p = 0; p < seen.size(); p++)
+    ASSERT_EQ(seen[p] % 2, 0) << "pair " << p;
+  delete buf_tree;
+}
+
+TEST(Combine, Churn) {
+  run_churn_test(FILE_STORAGE);
+  run_churn_test(MEMORY_STORAGE);
+}
+
+TEST(Combine, Reducer) {
+  // keep one copy of each update
+  reducer_t dedup = [](update_t *upds, size_t n) {
+    return (size_t) (std::unique(upds, upds + n) - upds);
+  };
+  run_combine_test(COMBINE_BUFFERS, FILE_STORAGE, dedup);
+}
+
+// without consumers try_insert must refuse updates rather than block, and
+// every update it accepts must reach the consumers once they start
+void run_backpressure_test(const int flush_workers, const storage_t storage) {
+  const int nodes = 64;
+  const int num_updates = 128000;
+  BufferTreeOptions opts;
+  opts.flush_workers = flush_workers;
+  opts.storage       = storage;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 4, 4, nodes, 1, true, opts);
+  shutdown = false;
+  upd_processed = 0;
+
+  int i = 0;
+  update_t upd;
+  for (; i < num_updates; i++) {
+    upd.first = i % nodes;
+    upd.second = (nodes - 1) - (i % nodes);
+    if (!buf_tree->try_insert(upd)) break;
+  }
+  ASSERT_LT(i, num_updates);
+
+  // the rest are accepted as the consumer makes room
+  std::thread qworker(querier, buf_tree, nodes);
+  std::vector<update_t> batch(1000);
+  while (i < num_updates) {
+    int n = std::min(1000, num_updates - i);
+    for (int j = 0; j < n; j++) {
+      batch[j].first = (i + j) % nodes;
+      batch[j].second = (nodes - 1) - ((i + j) % nodes);
+    }
+    size_t accepted = buf_tree->try_insert_batch(batch.data(), n);
+    if (accepted == 0) std::this_thread::yield();
+    i += accepted;
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(Backpressure, TryInsert) {
+  run_backpressure_test(0, FILE_STORAGE);
+  run_backpressure_test(0, MEMORY_STORAGE);
+  run_backpressure_test(2, FILE_STORAGE);
+}
+
+// try_insert must not block even while another producer is blocked in
+// insert, waiting on a consumer which has not started yet
+void run_blocked_producer_test(const storage_t storage) {
+  const int nodes = 64;
+  const int num_updates = 128000;
+  const int tries = 64000;
+  BufferTreeOptions opts;
+  opts.storage = storage;
+  BufferTree *buf_tree = new BufferTree("./test_", KB << 4, 4, nodes, 1, true, opts);
+  shutdown = false;
+  upd_processed = 0;
+
+  std::thread blocked([&]() {
+    for (int i = 0; i < num_updates; i++)
+      buf_tree->insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)});
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::atomic<bool> done(false);
+  std::atomic<int> accepted(0);
+  std::thread trying([&]() {
+    for (int i = 0; i < tries; i++) {
+      if (buf_tree->try_insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)}))
+        accepted++;
+    }
+    done = true;
+  });
+  for (int ms = 0; ms < 5000 && !done; ms++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(done) << "try_insert blocked";
+  ASSERT_LT(accepted, tries);
+
+  std::thread qworker(querier, buf_tree, nodes);
+  blocked.join();
+  trying.join();
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates + accepted, upd_processed);
+  delete buf_tree;
+}
+
+TEST(Backpressure, TryInsertBesideBlockedInsert) {
+  run_blocked_producer_test(FILE_STORAGE);
+  run_blocked_producer_test(MEMORY_STORAGE);
+}
+
+// narrower records must reach the consumers with their payloads intact,
+// through the compact encoding and radix kernel as well
+Node32Record::record_t make_update(Node src, Node dst, Node32Record) {
+  return {(uint32_t) src, (uint32_t) dst};
+}
+WeightedRecord::record_t make_update(Node src, Node dst, WeightedRecord) {
+  return {(uint32_t) src, {(uint32_t) dst, (float) src + 0.5f}};
+}
+uint32_t dst_of(uint32_t val, Node) {return val;}
+uint32_t dst_of(WeightedEdge val, Node key) {
+  EXPECT_EQ((float) key + 0.5f, val.weight);
+  return val.dst;
+}
+
+template <class Record>
+void run_record_test(const bool compact, const flush_kernel_t kernel) {
+  const int nodes = 200;
+  const int num_updates = 400000;
+  BasicBufferTreeOptions<Record> opts;
+  opts.flush_workers = 2;
+  opts.compact       = compact;
+  BasicBufferTree<Record> *buf_tree =
+    new BasicBufferTree<Record>("./test_", KB << 4, 4, nodes, 1, true, opts);
+  buf_tree->set_flush_kernel(kernel);
+  ASSERT_EQ(Record::size, BasicBufferTree<Record>::serial_update_size);
+  shutdown = false;
+  upd_processed = 0;
+  std::thread qworker([&]() {
+    typename BasicBufferTree<Record>::data_ret_t data;
+    while(true) {
+      if (buf_tree->get_data(data)) {
+        for (auto &val : data.second) {
+          ASSERT_EQ(nodes - (data.first + 1), dst_of(val, data.first)) << "key " << data.first;
+          upd_processed += 1;
+        }
+      }
+      else if(shutdown)
+        return;
+    }
+  });
+
+  std::vector<typename Record::record_t> batch;
+  for (int i = 0; i < num_updates; i++) {
+    batch.push_back(make_update(i % nodes, (nodes - 1) - (i % nodes), Record()));
+    if (batch.size() == 1000) {
+      buf_tree->insert_batch(batch.data(), batch.size());
+      batch.clear();
+    }
+  }
+  buf_tree->force_flush();
+  shutdown = true;
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(Records, Node32) {
+  run_record_test<Node32Record>(false, SCATTER_KERNEL);
+  run_record_test<Node32Record>(true, RADIX_KERNEL);
+}
+
+TEST(Records, Weighted) {
+  run_record_test<WeightedRecord>(false, RADIX_KERNEL);
+  run_record_test<WeightedRecord>(true, SCATTER_KERNEL);
+}
+
+// 32 bit records cannot hold 2^32 nodes or more
+TEST(Records, NodeRange) {
+  typedef BasicBufferTree<Node32Record> Tree32;
+  typedef BasicBufferTree<WeightedRecord> TreeWeighted;
+  Tree32::options_t opts32;
+  TreeWeighted::options_t weighted_opts;
+  ASSERT_THROW(Tree32("./test_", KB << 4, 4, 1ull << 32, 1, true, opts32), NodeRangeError);
+  ASSERT_THROW(TreeWeighted("./test_", KB << 4, 4, 1ull << 33, 1, true, weighted_opts), NodeRangeError);
+  opts32.first_key = 1ull << 31;
+  ASSERT_THROW(Tree32("./test_", KB << 4, 4, (1ull << 31) + 1, 1, true, opts32), NodeRangeError);
+  weighted_opts.graph_nodes = 1ull << 32;
+  ASSERT_THROW(TreeWeighted("./test_", KB << 4, 4, 64, 1, true, weighted_opts), NodeRangeError);
+
+  // the largest range which fits
+  opts32.first_key = (1ull << 32) - 64;
+  Tree32 *tree = new Tree32("./test_", KB << 4, 4, 64, 1, true, opts32);
+  delete tree;
+}
+
+// trees of different shapes used at once must not disturb one another
+TEST(Instances, TwoTrees) {
+  const int nodes[2] = {100, 5000};
+  const int num_updates = 200000;
+  BufferTreeOptions opts;
+  opts.flush_workers = 2;
+  BufferTree *trees[2];
+  trees[0] = new BufferTree("./test_a_", KB << 4, 4, nodes[0], 1, true, opts);
+  trees[1] = new BufferTree("./test_b_", MB, 16, nodes[1], 1, true);
+  ASSERT_NE(trees[0]->get_config().leaf_size, trees[1]->get_config().leaf_size);
+
+  std::atomic<uint32_t> processed[2];
+  std::thread qworkers[2];
+  for (int t = 0; t < 2; t++) {
+    processed[t] = 0;
+    qworkers[t] = std::thread([&, t]() {
+      data_ret_t data;
+      while (trees[t]->get_data(data)) {
+        for (Node upd : data.second)
+          ASSERT_EQ(nodes[t] - (data.first + 1), upd) << "tree " << t << " key " << data.first;
+        processed[t] += data.second.size();
+      }
+    });
+  }
+
+  for (int i = 0; i < num_updates; i++) {
+    for (int t = 0; t < 2; t++)
+      trees[t]->insert({(Node) i % nodes[t], (Node) (nodes[t] - 1) - (i % nodes[t])});
+  }
+  for (int t = 0; t < 2; t++) {
+    trees[t]->force_flush();
+    trees[t]->set_non_block(true);
+    qworkers[t].join();
+    ASSERT_EQ((uint32_t) num_updates, processed[t]);
+  }
+  delete trees[0];
+  delete trees[1];
+}
+
+// every update must reach the consumers through the shard owning its key,
+// with consumers stealing leaves from shards other than their own
+void run_sharded_test(const int num_shards, const bool leases) {
+  const int nodes = 1001; // not a multiple of the shards
+  const int num_updates = 400000;
+  const int producers = 2;
+  const int consumers = 3;
+  BufferTreeOptions opts;
+  opts.flush_workers = 1;
+  ShardedBufferTree *buf_tree = new ShardedBufferTree("./test_", KB << 4, 4, nodes, consumers,
+    true, num_shards, true, opts);
+  ASSERT_EQ((uint32_t) num_shards, buf_tree->num_shards());
+  ASSERT_EQ(0u, buf_tree->shard_of(0));
+  ASSERT_EQ((uint32_t) num_shards - 1, buf_tree->shard_of(nodes - 1));
+  // leaves are sized for all of the nodes, not just a shard's
+  for (int s = 0; s < num_shards; s++)
+    ASSERT_EQ((uint64_t) floor(24 * pow(log2(nodes), 3)), buf_tree->get_tree(s)->get_config().leaf_size);
+
+  upd_processed = 0;
+  std::thread qworkers[consumers];
+  for (int c = 0; c < consumers; c++) {
+    qworkers[c] = std::thread([&, c]() {
+      data_ret_t data;
+      LeafLease lease;
+      while (true) {
+        if (leases && buf_tree->lease_data(lease, c)) {
+          for (Node upd : lease)
+            ASSERT_EQ(nodes - (lease.key + 1), upd) << "key " << lease.key;
+          upd_processed += lease.count();
+          buf_tree->release_data(lease);
+        } else if (!leases && buf_tree->get_data(data, c)) {
+          for (Node upd : data.second)
+            ASSERT_EQ(nodes - (data.first + 1), upd) << "key " << data.first;
+          upd_processed += data.second.size();
+        } else
+          return;
+      }
+    });
+  }
+
+  std::thread pworkers[producers];
+  for (int p = 0; p < producers; p++) {
+    pworkers[p] = std::thread([&, p]() {
+      std::vector<update_t> batch;
+      for (int i = p; i < num_updates; i += producers) {
+        update_t upd = {(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)};
+        if (p == 0) buf_tree->insert(upd);
+        else batch.push_back(upd);
+        if (batch.size() == 5000) {
+          buf_tree->insert_batch(batch.data(), batch.size());
+          batch.clear();
+        }
+      }
+      buf_tree->insert_batch(batch.data(), batch.size());
+    });
+  }
+  for (int p = 0; p < producers; p++)
+    pworkers[p].join();
+  buf_tree->force_flush();
+  buf_tree->set_non_block(true);
+  for (int c = 0; c < consumers; c++)
+    qworkers[c].join();
+  ASSERT_EQ(num_updates, upd_processed);
+  delete buf_tree;
+}
+
+TEST(Sharded, GetData) {
+  run_sharded_test(1, false);
+  run_sharded_test(4, false);
+}
+
+TEST(Sharded, Leases) {
+  run_sharded_test(3, true);
+}
+
+// every shard gets at least a key per child of its root, however many are asked for
+TEST(Sharded, FewKeys) {
+  const int nodes = 7;
+  ShardedBufferTree *buf_tree = new ShardedBufferTree("./test_", KB << 4, 2, nodes, 1, true, 8, false,
+    BufferTreeOptions());
+  ASSERT_EQ(3u, buf_tree->num_shards());
+
+  upd_processed = 0;
+  std::thread qworker([&]() {
+    data_ret_t data;
+    while (buf_tree->get_data(data)) {
+      for (Node upd : data.second)
+        ASSERT_EQ(nodes - (data.first + 1), upd) << "key " << data.first;
+      upd_processed += data.second.size();
+    }
+  });
+  for (int i = 0; i < 10 * nodes; i++)
+    buf_tree->insert({(Node) i % nodes, (Node) (nodes - 1) - (i % nodes)});
+  buf_tree->force_flush();
+  buf_tree->set_non_block(true);
+  qworker.join();
+  ASSERT_EQ(10 * nodes, upd_processed);
+  delete buf_tree;
+}
+
+// every element pushed by many producers is peeked exactly once by many
+// consumers, and elements are not overwritten before they are popped
+TEST(CircularQueue, ManyProducersConsumers) {
+  const int producers = 4;
+  const int consumers = 4;
+  const uint64_t per_producer = 20000;
+  CircularQueue cq(8, sizeof(uint64_t) * 4);
+
+  std::atomic<uint64_t> sum(0);
+  std::atomic<uint64_t> count(0);
+  std::thread cons[consumers];
+  for (int c = 0; c < consumers; c++) {
+    cons[c] = std::thread([&]() {
+      std::pair<int, queue_elm> elm;
+      while (cq.peek(elm)) {
+        uint64_t vals[4];
+        memcpy(vals, elm.second.data, sizeof(vals));
+        ASSERT_EQ(sizeof(vals), elm.second.size);
+        for (int i = 1; i < 4; i++) ASSERT_EQ(vals[0], vals[i]);
+        sum += vals[0];
+        count++;
+        cq.pop(elm.first);
+      }
+    });
+  }
+  std::thread prods[producers];
+  for (int p = 0; p < producers; p++) {
+    prods[p] = std::thread([&, p]() {
+      for (uint64_t i = 1; i <= per_producer; i++) {
+        uint64_t v = p * per_producer + i;
+        uint64_t vals[4] = {v, v, v, v};
+        cq.push((char *) vals, sizeof(vals));
+      }
+    });
+  }
+  for (int p = 0; p < producers; p++) prods[p].join();
+  while (count < producers * per_producer) std::this_thread::yield();
+  cq.set_no_block(true);
+  for (int c = 0; c < consumers; c++) cons[c].join();
+
+  uint64_t n = producers * per_producer;
+  ASSERT_EQ(n, count);
+  ASSERT_EQ(n * (n + 1) / 2, sum);
+}
+
+// slots reserved in one order and committed in another are peeked in the
+// order they were reserved
+TEST(CircularQueue, ReserveCommit) {
+  CircularQueue cq(4, 64);
+  char *first, *second;
+  int i = cq.reserve(first);
+  int j = cq.reserve(second);
+  memset(second, 2, 64);
+  cq.commit(j, 32);
+  memset(first, 1, 64);
+  cq.commit(i, 64);
+
+  std::pair<int, queue_elm> elm;
+  ASSERT_TRUE(cq.peek(elm));
+  ASSERT_EQ(64, elm.second.size);
+  ASSERT_EQ(1, elm.second.data[63]);
+  cq.pop(elm.first);
+  ASSERT_TRUE(cq.peek(elm));
+  ASSERT_EQ(32, elm.second.size);
+  ASSERT_EQ(2, elm.second.data[0]);
+  cq.pop(elm.first);
+  cq.set_no_block(true);
+  ASSERT_FALSE(cq.peek(elm));
+}
+
+TEST(CircularQueue, AdaptiveDepth) {
+  CircularQueue fixed(2, 64);
+  CircularQueue adaptive(2, 64, 8);
+  char elm[64] = {};
+
+  // the adaptive queue grows to hold all 8 without a producer waiting
+  for (int i = 0; i < 8; i++) adaptive.push(elm, 64);
+  queue_stats_t stats = adaptive.get_stats();
+  ASSERT_EQ(8 * 64u, stats.depth_bytes);
+  ASSERT_GT(stats.grows, 0u);
+  ASSERT_EQ(0u, stats.producer_blocks);
+
+  // the fixed queue blocks its third push until a pop
+  fixed.push(elm, 64);
+  fixed.push(elm, 64);
+  std::thread consumer([&fixed]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::pair<int, queue_elm> got;
+    fixed.peek(got);
+    fixed.pop(got.first);
+  });
+  fixed.push(elm, 64);
+  consumer.join();
+  stats = fixed.get_stats();
+  ASSERT_EQ(2 * 64u, stats.depth_bytes);
+  ASSERT_EQ(1u, stats.producer_blocks);
+  ASSERT_GT(stats.producer_blocked_ns, 0u);
+}
+
+// elements pushed in place count against the depth like copied ones
+TEST(CircularQueue, LentDepth) {
+  CircularQueue adaptive(2, 64, 4);
+  char elm[64] = {};
+
+  // a free buffer gives up its room to a lent element
+  std::pair<int, queue_elm> got;
+  adaptive.push(elm, 64);
+  ASSERT_TRUE(adaptive.peek(got));
+  adaptive.pop(got.first);
+  ASSERT_TRUE(adaptive.try_push_ref(elm, 64));
+  ASSERT_TRUE(adaptive.try_push_ref(elm, 64));
+  ASSERT_EQ(0u, adaptive.get_stats().grows);
+
+  // the queue is full, so the third grows it and the fifth finds no room
+  ASSERT_TRUE(adaptive.try_push_ref(elm, 64));
+  ASSERT_EQ(1u, adaptive.get_stats().grows);
+  ASSERT_EQ(3 * 64u, adaptive.get_stats().depth_bytes);
+  ASSERT_TRUE(adaptive.try_push_ref(elm, 64));
+  ASSERT_EQ(4 * 64u, adaptive.get_stats().depth_bytes);
+  ASSERT_FALSE(adaptive.try_push_ref(elm, 64));
+  ASSERT_FALSE(adaptive.try_push(elm, 64));
+}
+
+// the precomputed routing must agree with the way setup_tree splits keys:
+// each child in turn takes ceil(remaining keys / remaining children)
+TEST(Routing, MatchesTreeLayout) {
+  const Node bases[] = {0, 12345, (Node) 1 << 40};
+  for (Node base : bases) {
+    for (Node total = 1; total <= 300; total++) {
+      for (uint16_t options : {2, 3, 8, 16, 256}) {
+        if (total < options && options != 256) continue;
+        ChildRouter router;
+        router.init(base, base + total - 1, options);
+
+        Node key = base;
+        Node remaining = total;
+        for (uint32_t child = 0; child < options && remaining > 0; child++) {
+          Node width = (remaining + (options - child) - 1) / (options - child);
+          for (Node k = 0; k < width; k++, key++) {
+            ASSERT_EQ(child, router.route(key)) << "key " << key << " total " << total << " options " << options;
+          }
+          remaining -= width;
+        }
+      }
+    }
+  }
+
+  // large key ranges where the reciprocal estimate is most likely off by one
+  const Node totals[] = {((Node) 1 << 62) + 12345, ((Node) 1 << 33) - 1};
+  for (Node total : totals) {
+    for (uint16_t options : {7, 256}) {
+      ChildRouter router;
+      router.init(0, total - 1, options);
+
+      Node key = 0;
+      Node remaining = total;
+      for (uint32_t child = 0; child < options; child++) {
+        Node width = (remaining + (options - child) - 1) / (options - child);
+        ASSERT_EQ(child, router.route(key));
+        ASSERT_EQ(child, router.route(key + width - 1));
+        key += width;
+        remaining -= width;
+      }
+    }
+  }
+}